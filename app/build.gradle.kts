@@ -52,6 +52,12 @@ android {
     }
     sourceSets["main"].jniLibs.srcDirs("src/main/jniLibs")
 
+    // GGUF models and baked KV snapshots (.kvs) must be stored uncompressed
+    // so native code can read them in place
+    androidResources {
+        noCompress += listOf("gguf", "kvs")
+    }
+
 }
 
 dependencies {
@@ -0,0 +1,223 @@
+#include "asset-extract.h"
+#include "content-hash.h"
+#include "llama.h"
+#include "native-log.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+struct IoBuffer {
+    uint8_t* data = nullptr;
+    size_t length = 0;  // bytes filled by the reader
+    uint64_t offset = 0; // position relative to the start of the range
+};
+
+// Blocking queue of buffer indices handed between the reader and the writer
+class BufferQueue {
+public:
+    void push(int index) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            items_.push_back(index);
+        }
+        cv_.notify_one();
+    }
+
+    // Returns -1 once the queue is closed and drained
+    int pop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return !items_.empty() || closed_; });
+        if (items_.empty()) {
+            return -1;
+        }
+        int index = items_.front();
+        items_.pop_front();
+        return index;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        cv_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<int> items_;
+    bool closed_ = false;
+};
+
+bool preadFully(int fd, uint8_t* dst, size_t length, int64_t offset) {
+    while (length > 0) {
+        ssize_t n = pread(fd, dst, length, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        dst += n;
+        length -= (size_t) n;
+        offset += n;
+    }
+    return true;
+}
+
+bool pwriteFully(int fd, const uint8_t* src, size_t length, int64_t offset) {
+    while (length > 0) {
+        ssize_t n = pwrite(fd, src, length, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        src += n;
+        length -= (size_t) n;
+        offset += n;
+    }
+    return true;
+}
+
+} // namespace
+
+bool extractRange(const FileRange& source, const std::string& destPath, const ExtractOptions& options) {
+    if (!source.valid()) {
+        return false;
+    }
+
+    const uint64_t total = (uint64_t) source.length;
+    const size_t bufferSize = options.bufferSize;
+    const int nBuffers = std::max(2, options.nBuffers);
+
+    if (options.chunkDigests && bufferSize != HASH_CHUNK_SIZE) {
+        LOGE("Chunk digests require bufferSize == HASH_CHUNK_SIZE");
+        return false;
+    }
+
+    int out = open(destPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out < 0) {
+        LOGE("Failed to open output file: %s", destPath.c_str());
+        return false;
+    }
+
+    // Reserve the blocks up front: no ENOSPC halfway through, and less fragmentation
+    if (total > 0) {
+        int err = posix_fallocate(out, 0, (off_t) total);
+        if (err == ENOSPC) {
+            LOGE("Not enough space to extract %llu bytes", (unsigned long long) total);
+            close(out);
+            unlink(destPath.c_str());
+            return false;
+        }
+    }
+    posix_fadvise(source.fd, source.offset, source.length, POSIX_FADV_SEQUENTIAL);
+
+    std::vector<IoBuffer> buffers(nBuffers);
+    for (auto& buffer : buffers) {
+        void* mem = nullptr;
+        if (posix_memalign(&mem, 4096, bufferSize) != 0) {
+            mem = nullptr;
+        }
+        buffer.data = static_cast<uint8_t*>(mem);
+    }
+    bool ok = std::all_of(buffers.begin(), buffers.end(), [](const IoBuffer& b) { return b.data != nullptr; });
+
+    BufferQueue freeQueue;
+    BufferQueue fullQueue;
+    for (int i = 0; i < nBuffers; i++) {
+        freeQueue.push(i);
+    }
+
+    std::atomic<bool> failed(!ok);
+    std::thread reader([&]() {
+        uint64_t pos = 0;
+        while (pos < total && !failed) {
+            int index = freeQueue.pop();
+            if (index < 0) break;
+
+            IoBuffer& buffer = buffers[index];
+            buffer.offset = pos;
+            buffer.length = (size_t) std::min<uint64_t>(bufferSize, total - pos);
+            if (!preadFully(source.fd, buffer.data, buffer.length, source.offset + (int64_t) pos)) {
+                LOGE("Read failed at offset %llu: %s", (unsigned long long) pos, strerror(errno));
+                failed = true;
+                break;
+            }
+            pos += buffer.length;
+            fullQueue.push(index);
+        }
+        fullQueue.close();
+    });
+
+    if (options.chunkDigests) {
+        options.chunkDigests->clear();
+        if (total == 0) {
+            options.chunkDigests->push_back(xxh64(nullptr, 0, 0));
+        }
+    }
+
+    const int64_t t_start = llama_time_us();
+    int64_t t_last_report = t_start;
+    uint64_t done = 0;
+
+    auto report = [&](int64_t now) {
+        if (!options.onProgress) return;
+        ExtractProgress progress;
+        progress.done = done;
+        progress.total = total;
+        const double seconds = (now - t_start) / 1e6;
+        progress.mb_per_s = seconds > 0 ? (done / (1024.0 * 1024.0)) / seconds : 0.0;
+        options.onProgress(progress);
+    };
+
+    // Writer: runs on the calling thread so progress callbacks can use its JNIEnv
+    for (int index = fullQueue.pop(); index >= 0; index = fullQueue.pop()) {
+        IoBuffer& buffer = buffers[index];
+        if (!failed) {
+            if (options.chunkDigests) {
+                options.chunkDigests->push_back(xxh64(buffer.data, buffer.length, 0));
+            }
+            if (!pwriteFully(out, buffer.data, buffer.length, (int64_t) buffer.offset)) {
+                LOGE("Write failed at offset %llu: %s", (unsigned long long) buffer.offset, strerror(errno));
+                failed = true;
+            } else {
+                done += buffer.length;
+            }
+        }
+        freeQueue.push(index);
+
+        const int64_t now = llama_time_us();
+        if (now - t_last_report >= options.progressIntervalUs) {
+            report(now);
+            t_last_report = now;
+        }
+    }
+    freeQueue.close();
+    reader.join();
+
+    if (!failed && fsync(out) != 0) {
+        LOGE("fsync failed for %s: %s", destPath.c_str(), strerror(errno));
+        failed = true;
+    }
+    close(out);
+
+    for (auto& buffer : buffers) {
+        free(buffer.data);
+    }
+
+    if (failed || done != total) {
+        unlink(destPath.c_str());
+        return false;
+    }
+
+    const int64_t t_end = llama_time_us();
+    report(t_end);
+    LOGI("Extracted %.1f MB in %.1f ms", total / (1024.0 * 1024.0), (t_end - t_start) / 1000.0);
+    return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "asset-mmap.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct ExtractProgress {
+    uint64_t done = 0;
+    uint64_t total = 0;
+    double mb_per_s = 0.0;
+};
+
+using ExtractProgressCallback = std::function<void(const ExtractProgress&)>;
+
+struct ExtractOptions {
+    // Buffers are page aligned and equal to the hash chunk size so every
+    // buffer contributes exactly one digest to the content hash
+    size_t bufferSize = 8u << 20;
+    int nBuffers = 4;
+
+    // Called on the calling thread, at most once per interval and once at the end
+    ExtractProgressCallback onProgress;
+    int64_t progressIntervalUs = 250000;
+
+    // If set, receives the XXH64 digest of each HASH_CHUNK_SIZE chunk
+    std::vector<uint64_t>* chunkDigests = nullptr;
+};
+
+// Copies `source` to `destPath`. A reader thread fills aligned buffers with
+// pread() while the calling thread writes them out with pwrite(), so reads
+// and writes overlap. The destination is pre-sized with fallocate() and
+// fsynced before returning.
+bool extractRange(const FileRange& source, const std::string& destPath, const ExtractOptions& options = ExtractOptions());
@@ -0,0 +1,112 @@
+#include "asset-mmap.h"
+#include "native-log.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+FileRange::~FileRange() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool openFileRange(const std::string& path, int64_t offset, int64_t length, FileRange& out) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("Failed to open file: %s", path.c_str());
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || offset < 0 || offset > st.st_size) {
+        LOGE("Invalid range for file: %s", path.c_str());
+        close(fd);
+        return false;
+    }
+
+    if (length < 0 || offset + length > st.st_size) {
+        length = st.st_size - offset;
+    }
+
+    out.fd = fd;
+    out.offset = offset;
+    out.length = length;
+    return true;
+}
+
+#ifdef __ANDROID__
+bool openAssetRange(AAssetManager* mgr, const std::string& assetPath, FileRange& out) {
+    AAsset* asset = AAssetManager_open(mgr, assetPath.c_str(), AASSET_MODE_RANDOM);
+    if (!asset) {
+        LOGE("Failed to open asset: %s", assetPath.c_str());
+        return false;
+    }
+
+    off64_t start = 0;
+    off64_t length = 0;
+    int fd = AAsset_openFileDescriptor64(asset, &start, &length);
+    AAsset_close(asset);
+
+    if (fd < 0) {
+        LOGE("Asset is compressed, cannot map it in place: %s", assetPath.c_str());
+        return false;
+    }
+
+    out.fd = fd;
+    out.offset = start;
+    out.length = length;
+    return true;
+}
+#endif
+
+MappedRegion::~MappedRegion() {
+    unmap();
+}
+
+bool MappedRegion::map(const FileRange& range) {
+    unmap();
+    if (!range.valid() || range.length <= 0) {
+        return false;
+    }
+
+    // mmap offsets must be page aligned; assets inside an APK usually are not
+    const int64_t page = sysconf(_SC_PAGESIZE);
+    const int64_t alignedOffset = range.offset - (range.offset % page);
+    const size_t delta = (size_t) (range.offset - alignedOffset);
+    const size_t mappedSize = delta + (size_t) range.length;
+
+    void* base = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, range.fd, alignedOffset);
+    if (base == MAP_FAILED) {
+        LOGE("mmap failed for %lld bytes at offset %lld", (long long) range.length, (long long) range.offset);
+        return false;
+    }
+
+    base_ = base;
+    mappedSize_ = mappedSize;
+    data_ = static_cast<const uint8_t*>(base) + delta;
+    size_ = (size_t) range.length;
+    return true;
+}
+
+void MappedRegion::unmap() {
+    if (base_) {
+        munmap(base_, mappedSize_);
+    }
+    base_ = nullptr;
+    mappedSize_ = 0;
+    data_ = nullptr;
+    size_ = 0;
+}
+
+void MappedRegion::adviseSequential() {
+    if (base_) {
+        madvise(base_, mappedSize_, MADV_SEQUENTIAL);
+    }
+}
+
+void MappedRegion::adviseWillNeed() {
+    if (base_) {
+        madvise(base_, mappedSize_, MADV_WILLNEED);
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef __ANDROID__
+#include <android/asset_manager.h>
+#endif
+
+// A byte range inside an open file: a whole file on disk, or an uncompressed
+// asset stored inside the APK at some offset
+struct FileRange {
+    int fd = -1;
+    int64_t offset = 0;
+    int64_t length = 0;
+
+    FileRange() = default;
+    FileRange(const FileRange&) = delete;
+    FileRange& operator=(const FileRange&) = delete;
+    ~FileRange();
+
+    bool valid() const { return fd >= 0; }
+};
+
+// Opens [offset, offset + length) of a regular file; length < 0 means to end of file
+bool openFileRange(const std::string& path, int64_t offset, int64_t length, FileRange& out);
+
+#ifdef __ANDROID__
+// Opens the asset's byte range inside the APK. Fails for compressed assets,
+// so model files must be listed under noCompress in the Gradle config.
+bool openAssetRange(AAssetManager* mgr, const std::string& assetPath, FileRange& out);
+#endif
+
+// Read-only, shared mapping of a FileRange. Pages come straight from the page
+// cache, so several processes mapping the same APK share the same memory.
+class MappedRegion {
+public:
+    MappedRegion() = default;
+    MappedRegion(const MappedRegion&) = delete;
+    MappedRegion& operator=(const MappedRegion&) = delete;
+    ~MappedRegion();
+
+    bool map(const FileRange& range);
+    void unmap();
+
+    // Hints for a single front-to-back pass (hashing, copying)
+    void adviseSequential();
+    void adviseWillNeed();
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool valid() const { return data_ != nullptr; }
+
+private:
+    void* base_ = nullptr;
+    size_t mappedSize_ = 0;
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+};
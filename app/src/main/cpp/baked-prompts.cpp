@@ -0,0 +1,25 @@
+#include "baked-prompts.h"
+#include "content-hash.h"
+#include <cstdint>
+
+std::string bakedPromptAssetPath(const std::string& modelHash, const std::string& systemPrompt) {
+    const std::string promptHash = hashContent((const uint8_t*) systemPrompt.data(), systemPrompt.size(), 1);
+    return std::string(BAKED_PROMPT_DIR) + "/" + modelHash + "/" + promptHash + ".kvs";
+}
+
+std::string modelHashFromStorePath(const std::string& modelPath) {
+    size_t lastSlash = modelPath.find_last_of('/');
+    std::string filename = (lastSlash != std::string::npos) ? modelPath.substr(lastSlash + 1) : modelPath;
+
+    const std::string ext = ".gguf";
+    if (filename.size() != 16 + ext.size() || filename.compare(16, ext.size(), ext) != 0) {
+        return "";
+    }
+    for (size_t i = 0; i < 16; i++) {
+        char c = filename[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return "";
+        }
+    }
+    return filename.substr(0, 16);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+
+// System-prompt snapshots baked at build time by tools/bake-prompts and
+// shipped as assets, so a new session starts with its system prompt
+// already in the KV cache.
+//
+// Layout inside the asset bundle: kv/<model hash>/<prompt hash>.kvs, where
+// the model hash is the ModelStore content hash and the prompt hash is
+// hashContent() of the system prompt text.
+
+// Directory of baked prompts inside the asset bundle
+constexpr const char* BAKED_PROMPT_DIR = "kv";
+
+// Asset path of the baked snapshot for `systemPrompt` under `modelHash`
+std::string bakedPromptAssetPath(const std::string& modelHash, const std::string& systemPrompt);
+
+// Model hash of a path installed by ModelStore (".../<hash>.gguf"), or an
+// empty string if the file name is not a store blob name
+std::string modelHashFromStorePath(const std::string& modelPath);
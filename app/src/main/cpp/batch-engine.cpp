@@ -0,0 +1,1078 @@
+#include "batch-engine.h"
+#include "context-shift.h"
+#include "model-registry.h"
+#include "ngram-cache.h"
+#include "native-log.h"
+#include "prefill.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+struct BatchEngine::Request {
+    std::vector<llama_token> tokens; // prompt, then every sampled token
+    size_t n_prompt = 0;
+    int maxTokens = 0;
+    llama_sampler* sampler = nullptr;
+    std::shared_ptr<CancelToken> cancel;
+
+    // Engine thread only
+    llama_seq_id seq = -1;
+    size_t n_past = 0;      // tokens of this request processed so far
+    size_t n_shifted = 0;   // of those, tokens context shifts dropped from the KV cache
+    llama_token next = -1;  // sampled but not decoded yet
+    int n_batched = 0;      // prompt tokens in the current batch
+    int32_t logitsIdx = -1; // logits row in the current batch, or -1
+    bool stream = true;     // pieces go to `pending` as they are sampled
+    bool streamed = false;  // text has reached the caller, so it cannot be restarted
+    int64_t t_start = 0;
+
+    std::unique_ptr<DraftChain> draft;
+    std::shared_ptr<NgramCache> ngramCache; // learns from this request once it finishes
+    DraftLength draftLength{2, 8};
+    int maxBranches = 1;
+
+    // Draft batched after `next` in the current step. Branch 0 lives in
+    // `seq`, every other branch in a borrowed sequence that shares the
+    // committed cells through llama_memory_seq_cp.
+    DraftTree tree;
+    std::vector<int32_t> nodeIdx; // logits row of each tree node
+    std::vector<llama_seq_id> branchSeqs;
+    int n_drafted = 0;
+    int n_accepted = 0;
+
+    // Completions of the same prompt that take over this request's KV cells
+    // once its prefill is done, instead of prefilling it themselves
+    std::vector<std::shared_ptr<Request>> forks;
+
+    // Beam search (beamWidth > 0) instead of sampling. Every live beam has a
+    // sequence holding the prompt and its tokens but the last, which is
+    // decoded in the next step.
+    struct Beam {
+        llama_seq_id seq = -1;
+        std::vector<llama_token> tokens; // generated so far
+        double logprob = 0.0;            // of all of `tokens`
+        int32_t logitsIdx = -1;
+    };
+    int beamWidth = 0;
+    std::vector<Beam> beams;
+    std::vector<Beam> finished;         // ended with end of generation or maxTokens
+    std::vector<llama_seq_id> beamSeqs; // held besides `seq`
+
+    // Shared with the caller, guarded by BatchEngine::mutex_
+    std::condition_variable cv;
+    std::string pending;
+    EngineResult result;
+    bool done = false;
+
+    bool prefilling() const { return n_past < n_prompt; }
+    llama_pos pos() const { return (llama_pos) (n_past - n_shifted); } // KV position of `next`
+    bool cancelled() const { return cancel && cancel->expired(); }
+
+    ~Request() {
+        if (sampler) {
+            llama_sampler_free(sampler);
+        }
+    }
+};
+
+namespace {
+
+// Prompt tokens a step may always take, so prefills progress even when
+// decode tokens alone fill the budget
+const int32_t MIN_PREFILL_TOKENS = 16;
+
+void batchAdd(llama_batch& batch, llama_token token, llama_pos pos, const llama_seq_id* seqs, int n_seqs,
+              bool logits) {
+    const int32_t i = batch.n_tokens++;
+    batch.token[i] = token;
+    batch.pos[i] = pos;
+    batch.n_seq_id[i] = n_seqs;
+    for (int s = 0; s < n_seqs; s++) {
+        batch.seq_id[i][s] = seqs[s];
+    }
+    batch.logits[i] = logits;
+}
+
+void batchAdd(llama_batch& batch, llama_token token, llama_pos pos, llama_seq_id seq, bool logits) {
+    batchAdd(batch, token, pos, &seq, 1, logits);
+}
+
+// Sampler chain up to, but not including, the final random pick
+llama_sampler* makeSamplerBase() {
+    llama_sampler_chain_params sparams = llama_sampler_chain_default_params();
+    llama_sampler* chain = llama_sampler_chain_init(sparams);
+    llama_sampler_chain_add(chain, llama_sampler_init_top_k(40));
+    llama_sampler_chain_add(chain, llama_sampler_init_top_p(0.9f, 1));
+    llama_sampler_chain_add(chain, llama_sampler_init_temp(0.8f));
+    return chain;
+}
+
+const uint32_t SAMPLER_SEED = 1337;
+
+// The `k` most likely tokens of a logits row, as (log-probability, token)
+void topLogProbs(const float* logits, int32_t n_vocab, size_t k, std::vector<std::pair<float, llama_token>>& out) {
+    float max = logits[0];
+    for (int32_t i = 1; i < n_vocab; i++) {
+        max = std::max(max, logits[i]);
+    }
+    double sum = 0.0;
+    for (int32_t i = 0; i < n_vocab; i++) {
+        sum += std::exp(logits[i] - max);
+    }
+    const float logZ = max + (float) std::log(sum);
+
+    // Min-heap of the best k seen so far
+    out.clear();
+    const auto worse = std::greater<std::pair<float, llama_token>>();
+    for (int32_t i = 0; i < n_vocab; i++) {
+        if (out.size() < k) {
+            out.emplace_back(logits[i], i);
+            std::push_heap(out.begin(), out.end(), worse);
+        } else if (logits[i] > out.front().first) {
+            std::pop_heap(out.begin(), out.end(), worse);
+            out.back() = {logits[i], i};
+            std::push_heap(out.begin(), out.end(), worse);
+        }
+    }
+    for (auto& top : out) {
+        top.first -= logZ;
+    }
+}
+
+} // namespace
+
+BatchEngine::BatchEngine(LoadedModel& model) : model_(model), stepBudget_(0) {
+    // Tree drafts put one token in several sequences
+    batch_ = llama_batch_init((int32_t) llama_n_batch(model_.ctx), 0, (int32_t) llama_n_seq_max(model_.ctx));
+    setStepBudget(model_.config.step_token_budget);
+}
+
+BatchEngine::~BatchEngine() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    llama_batch_free(batch_);
+}
+
+std::string BatchEngine::checkPrompt(const std::vector<llama_token>& tokens) const {
+    if (tokens.empty()) {
+        return "failed to tokenize prompt";
+    }
+    if (tokens.size() >= llama_n_ctx(model_.ctx)) {
+        return prefillStatusMessage(PREFILL_CONTEXT_FULL);
+    }
+    return "";
+}
+
+bool BatchEngine::submit(const std::shared_ptr<Request>& req) {
+    if (stopping_) {
+        return false;
+    }
+    if (!thread_.joinable()) {
+        thread_ = std::thread(&BatchEngine::run, this);
+    }
+    queue_.push_back(req);
+    cv_.notify_all();
+    return true;
+}
+
+EngineResult BatchEngine::generate(const std::string& prompt, int maxTokens, const PieceFn& onPiece,
+                                   std::shared_ptr<CancelToken> cancel) {
+    const llama_vocab* vocab = llama_model_get_vocab(model_.model);
+
+    auto req = std::make_shared<Request>();
+    req->cancel = std::move(cancel);
+    req->tokens = tokenizeText(vocab, prompt, true);
+    req->n_prompt = req->tokens.size();
+    req->maxTokens = maxTokens;
+    req->result.n_prompt = (int) req->n_prompt;
+
+    req->result.error = checkPrompt(req->tokens);
+    if (!req->result.error.empty()) {
+        return req->result;
+    }
+
+    req->sampler = makeSamplerBase();
+    llama_sampler_chain_add(req->sampler, llama_sampler_init_dist(SAMPLER_SEED));
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!submit(req)) {
+        req->result.error = "model is unloading";
+        return req->result;
+    }
+
+    // Hand text to the caller's thread as it arrives
+    while (true) {
+        req->cv.wait(lock, [&] { return req->done || !req->pending.empty(); });
+        if (!req->pending.empty()) {
+            std::string piece;
+            piece.swap(req->pending);
+            lock.unlock();
+            if (onPiece) {
+                onPiece(piece.data(), piece.size());
+            }
+            lock.lock();
+            continue;
+        }
+        return req->result;
+    }
+}
+
+EngineResult BatchEngine::generateBeam(const std::string& prompt, int beamWidth, int maxTokens,
+                                       std::shared_ptr<CancelToken> cancel) {
+    const llama_vocab* vocab = llama_model_get_vocab(model_.model);
+
+    auto req = std::make_shared<Request>();
+    req->cancel = std::move(cancel);
+    req->tokens = tokenizeText(vocab, prompt, true);
+    req->n_prompt = req->tokens.size();
+    req->maxTokens = maxTokens;
+    req->stream = false;
+    req->beamWidth = std::max(1, std::min(beamWidth, (int) llama_n_seq_max(model_.ctx)));
+    req->result.n_prompt = (int) req->n_prompt;
+
+    req->result.error = checkPrompt(req->tokens);
+    if (!req->result.error.empty()) {
+        return req->result;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!submit(req)) {
+        req->result.error = "model is unloading";
+        return req->result;
+    }
+    req->cv.wait(lock, [&] { return req->done; });
+    return req->result;
+}
+
+std::vector<EngineResult> BatchEngine::generateN(const std::string& prompt, int n, int maxTokens,
+                                                std::shared_ptr<CancelToken> cancel) {
+    const llama_vocab* vocab = llama_model_get_vocab(model_.model);
+    const std::vector<llama_token> tokens = tokenizeText(vocab, prompt, true);
+
+    std::vector<EngineResult> results(std::max(1, n));
+    const std::string error = checkPrompt(tokens);
+    if (!error.empty()) {
+        for (auto& result : results) {
+            result.error = error;
+        }
+        return results;
+    }
+
+    // Every completion gets a copy of one chain and its own seed, so they
+    // share settings but not their random draws
+    llama_sampler* base = makeSamplerBase();
+    std::vector<std::shared_ptr<Request>> reqs;
+    for (size_t i = 0; i < results.size(); i++) {
+        auto req = std::make_shared<Request>();
+        req->cancel = cancel;
+        req->tokens = tokens;
+        req->n_prompt = tokens.size();
+        req->maxTokens = maxTokens;
+        req->stream = false;
+        req->result.n_prompt = (int) tokens.size();
+        req->sampler = llama_sampler_clone(base);
+        llama_sampler_chain_add(req->sampler, llama_sampler_init_dist(SAMPLER_SEED + (uint32_t) i));
+        reqs.push_back(req);
+    }
+    llama_sampler_free(base);
+
+    // Only the first one is queued; it prefills the prompt for all of them
+    reqs[0]->forks.assign(reqs.begin() + 1, reqs.end());
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!submit(reqs[0])) {
+        for (auto& result : results) {
+            result.error = "model is unloading";
+        }
+        return results;
+    }
+    for (size_t i = 0; i < reqs.size(); i++) {
+        reqs[i]->cv.wait(lock, [&] { return reqs[i]->done; });
+        results[i] = reqs[i]->result;
+    }
+    return results;
+}
+
+BatchEngine::Stats BatchEngine::stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void BatchEngine::setStepBudget(int tokens) {
+    const int n_batch = (int) llama_n_batch(model_.ctx);
+    stepBudget_.store(std::max(1, std::min(tokens, n_batch)));
+}
+
+bool BatchEngine::setSpeculation(const SpeculativeConfig& config) {
+    if (config.draftModel && !vocabsCompatible(model_.model, config.draftModel->model)) {
+        LOGE("Draft model %s does not share the vocabulary of %s", config.draftModel->path.c_str(),
+             model_.path.c_str());
+        return false;
+    }
+
+    // Drafting holds the target's mutex while it takes the draft's, so a
+    // chain of draft models that leads back here could deadlock. The chains
+    // are checked and changed under one lock so two calls cannot close a cycle together.
+    static std::mutex chainMutex;
+    std::lock_guard<std::mutex> chainLock(chainMutex);
+    for (std::shared_ptr<LoadedModel> draft = config.draftModel; draft;
+         draft = draft->engine->speculation().draftModel) {
+        if (draft.get() == &model_) {
+            LOGE("Draft model %s drafts for %s, directly or through other drafts", config.draftModel->path.c_str(),
+                 model_.path.c_str());
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    speculation_ = config;
+    speculation_.n_draft_min = std::max(1, config.n_draft_min);
+    speculation_.n_draft_max = std::max(speculation_.n_draft_min, config.n_draft_max);
+    speculation_.maxBranches = std::max(1, std::min({config.maxBranches, DraftTree::MAX_BRANCHES,
+                                                     (int) llama_n_seq_max(model_.ctx)}));
+    return true;
+}
+
+SpeculativeConfig BatchEngine::speculation() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return speculation_;
+}
+
+void BatchEngine::run() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ || !queue_.empty() || !active_.empty(); });
+            if (stopping_) {
+                break;
+            }
+        }
+
+        dropCancelled();
+
+        bool idle;
+        {
+            // Chat sessions share the context, so they interleave with steps
+            std::lock_guard<std::mutex> modelLock(model_.mutex);
+            admit();
+            idle = active_.empty();
+            if (!idle) {
+                step();
+            }
+        }
+
+        if (idle) {
+            // Every sequence is held by a chat session; wait for one to close
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    std::lock_guard<std::mutex> modelLock(model_.mutex);
+    while (!active_.empty()) {
+        finish(active_.back(), "model is unloading");
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& req : queue_) {
+        complete(*req, "model is unloading");
+    }
+    queue_.clear();
+}
+
+void BatchEngine::dropCancelled() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = queue_.begin(); it != queue_.end();) {
+        const std::shared_ptr<Request>& req = *it;
+        if (!req->cancelled()) {
+            ++it;
+            continue;
+        }
+        complete(*req, req->cancel->reason());
+        it = queue_.erase(it);
+    }
+}
+
+void BatchEngine::admit() {
+    while (!admitPaused_) {
+        std::shared_ptr<Request> req;
+        SpeculativeConfig speculation;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (queue_.empty()) {
+                return;
+            }
+            req = queue_.front();
+            speculation = speculation_;
+        }
+
+        llama_seq_id seq = model_.acquireSeq();
+        if (seq < 0) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.pop_front();
+        }
+
+        req->seq = seq;
+        req->t_start = llama_time_us();
+        // Start from the longest prompt prefix an earlier request left behind
+        req->n_past = model_.prefixCache->restore(model_.ctx, req->tokens, seq);
+        active_.push_back(req);
+
+        if (!req->draft && req->beamWidth == 0) {
+            setUpDraft(*req, speculation);
+        }
+
+        LOGI("Engine admitted request on seq %d: %zu prompt tokens, %zu reused, %zu active", seq,
+             req->n_prompt, req->n_past, active_.size());
+    }
+}
+
+void BatchEngine::setUpDraft(Request& req, const SpeculativeConfig& speculation) {
+    std::unique_ptr<DraftChain> chain(new DraftChain());
+    if (speculation.promptLookup) {
+        chain->add(std::unique_ptr<DraftSource>(new PromptLookupSource()));
+    }
+    if (speculation.ngramCache) {
+        chain->add(std::unique_ptr<DraftSource>(new NgramCacheSource(speculation.ngramCache)));
+    }
+    if (speculation.draftModel) {
+        chain->add(DraftModelSource::create(speculation.draftModel,
+                                            llama_vocab_n_tokens(llama_model_get_vocab(model_.model))));
+    }
+    req.ngramCache = speculation.ngramCache;
+    if (!chain->empty()) {
+        req.draft = std::move(chain);
+        req.draftLength = DraftLength(speculation.n_draft_min, speculation.n_draft_max);
+        req.maxBranches = speculation.maxBranches;
+    }
+}
+
+std::vector<std::shared_ptr<BatchEngine::Request>> BatchEngine::fork(const std::shared_ptr<Request>& req) {
+    std::vector<std::shared_ptr<Request>> forked;
+    if (req->forks.empty()) {
+        return forked;
+    }
+
+    SpeculativeConfig speculation;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        speculation = speculation_;
+    }
+
+    // The copies share the prompt's cells, so the prompt is stored once and
+    // every completion starts sampling from the same logits row
+    llama_memory_t mem = llama_get_memory(model_.ctx);
+    std::vector<std::shared_ptr<Request>> queued;
+    for (auto& child : req->forks) {
+        llama_seq_id seq = model_.acquireSeq();
+        if (seq < 0) {
+            queued.push_back(child);
+            continue;
+        }
+        llama_memory_seq_cp(mem, req->seq, seq, -1, -1);
+        child->seq = seq;
+        child->n_past = req->n_past;
+        child->logitsIdx = req->logitsIdx;
+        child->t_start = req->t_start;
+        setUpDraft(*child, speculation);
+        active_.push_back(child);
+        forked.push_back(child);
+    }
+    req->forks.clear();
+
+    if (!queued.empty()) {
+        // Sequences ran out; the rest prefill on their own, from the prefix cache
+        LOGI("Engine forked %zu completions, %zu wait for a sequence", forked.size(), queued.size());
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.insert(queue_.begin(), queued.begin(), queued.end());
+    }
+    return forked;
+}
+
+void BatchEngine::step() {
+    llama_context* ctx = model_.ctx;
+    const int32_t n_batch = (int32_t) llama_n_batch(ctx);
+
+    // Stopped requests leave before the batch is built, freeing their
+    // sequences; one that reached the end of the context shifts or stops
+    const int32_t n_ctx = (int32_t) llama_n_ctx(ctx);
+    const std::vector<std::shared_ptr<Request>> running = active_;
+    for (const auto& req : running) {
+        if (req->cancelled()) {
+            finish(req, req->cancel->reason());
+        } else if (!req->prefilling() && req->pos() + 1 >= n_ctx && !shift(*req, 1)) {
+            finish(req);
+        }
+    }
+    if (active_.empty()) {
+        return;
+    }
+
+    batch_.n_tokens = 0;
+
+    // One decode token per generating sequence, followed by its draft if it
+    // speculates. Every drafted token gets logits so all are checked at once.
+    for (auto& req : active_) {
+        req->n_batched = 0;
+        req->logitsIdx = -1;
+        req->tree.clear();
+        if (req->prefilling()) {
+            continue;
+        }
+
+        if (req->beamWidth > 0) {
+            for (auto& beam : req->beams) {
+                batchAdd(batch_, beam.tokens.back(), req->pos(), beam.seq, true);
+                beam.logitsIdx = batch_.n_tokens - 1;
+            }
+            req->logitsIdx = req->beams.empty() ? -1 : req->beams.front().logitsIdx;
+            continue;
+        }
+
+        if (req->draft) {
+            draftFor(*req, n_batch - batch_.n_tokens - 1 - MIN_PREFILL_TOKENS);
+        }
+
+        // `next` and every tree node go to all sequences of the branches through them
+        llama_seq_id seqs[DraftTree::MAX_BRANCHES];
+        seqs[0] = req->seq;
+        for (size_t b = 0; b < req->branchSeqs.size(); b++) {
+            seqs[1 + b] = req->branchSeqs[b];
+        }
+        batchAdd(batch_, req->next, req->pos(), seqs, 1 + (int) req->branchSeqs.size(), true);
+        req->logitsIdx = batch_.n_tokens - 1;
+
+        req->nodeIdx.resize(req->tree.nodes.size());
+        for (size_t i = 0; i < req->tree.nodes.size(); i++) {
+            const DraftTree::Node& node = req->tree.nodes[i];
+            llama_seq_id nodeSeqs[DraftTree::MAX_BRANCHES];
+            int n_seqs = 0;
+            for (int b = 0; b < req->tree.n_branches; b++) {
+                if (node.branches & (1u << b)) {
+                    nodeSeqs[n_seqs++] = seqs[b];
+                }
+            }
+            batchAdd(batch_, node.token, req->pos() + 1 + node.depth, nodeSeqs, n_seqs, true);
+            req->nodeIdx[i] = batch_.n_tokens - 1;
+        }
+    }
+
+    // Prompts share what is left of the step, oldest request first. The
+    // budget only applies while someone is waiting for their next token.
+    const int32_t n_decode = batch_.n_tokens;
+    int32_t limit = n_batch;
+    if (n_decode > 0) {
+        limit = std::min(n_batch, std::max(stepBudget_.load(), n_decode + MIN_PREFILL_TOKENS));
+    }
+
+    for (auto& req : active_) {
+        const int32_t room = limit - batch_.n_tokens;
+        if (room <= 0) {
+            break;
+        }
+        if (!req->prefilling()) {
+            continue;
+        }
+        const int32_t n = std::min(room, (int32_t) (req->n_prompt - req->n_past));
+        for (int32_t i = 0; i < n; i++) {
+            const size_t pos = req->n_past + i;
+            batchAdd(batch_, req->tokens[pos], (llama_pos) pos, req->seq, pos + 1 == req->n_prompt);
+        }
+        req->n_batched = n;
+        if (req->n_past + n == req->n_prompt) {
+            req->logitsIdx = batch_.n_tokens - 1;
+        }
+    }
+
+    // A request cancelled mid-decode aborts the whole batch; the others
+    // simply run again next step
+    model_.abortCheck = [this] {
+        for (const auto& req : active_) {
+            if (req->cancelled()) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    const int64_t t_start = llama_time_us();
+    const int32_t ret = llama_decode(ctx, batch_);
+    const int64_t t_decode = llama_time_us() - t_start;
+
+    model_.abortCheck = nullptr;
+
+    if (ret != 0) {
+        // llama_decode only rolls back the ubatch it stopped in; cells that
+        // earlier ubatches of this step wrote would be decoded again next
+        // step, so drop everything each sequence got from this batch
+        llama_memory_t mem = llama_get_memory(ctx);
+        for (auto& req : active_) {
+            if (req->prefilling() && req->n_batched == 0) {
+                continue;
+            }
+            const llama_pos p0 = req->pos(); // first position batched for it
+            llama_memory_seq_rm(mem, req->seq, p0, -1);
+            for (const auto& beam : req->beams) {
+                llama_memory_seq_rm(mem, beam.seq, p0, -1);
+            }
+            for (llama_seq_id seq : req->branchSeqs) {
+                llama_memory_seq_rm(mem, seq, p0, -1);
+            }
+            releaseBranches(*req);
+        }
+    }
+    if (ret == 1 || ret == 2) {
+        if (ret == 1) {
+            // Not enough KV cells for everyone
+            preemptNewest();
+        } else {
+            LOGI("Engine decode aborted for a cancelled request");
+        }
+        return;
+    }
+    if (ret != 0) {
+        LOGE("Engine decode failed: %d", ret);
+        while (!active_.empty()) {
+            finish(active_.back(), "failed to decode");
+        }
+        return;
+    }
+
+    uint64_t n_prompt = 0;
+    uint64_t n_generated = 0;
+
+    // finish() removes requests from active_
+    const std::vector<std::shared_ptr<Request>> batched = active_;
+    for (const auto& req : batched) {
+        if (req->n_batched > 0) {
+            req->n_past += req->n_batched;
+            n_prompt += req->n_batched;
+            if (!req->prefilling()) {
+                model_.prefixCache->insert(ctx, req->tokens.data(), req->n_prompt, req->seq);
+                for (const auto& child : fork(req)) {
+                    verify(child);
+                    n_generated += child->result.n_generated;
+                }
+            }
+        } else if (req->logitsIdx >= 0) {
+            req->n_past++;
+        }
+
+        if (req->logitsIdx >= 0) {
+            const int before = req->result.n_generated;
+            if (req->beamWidth > 0) {
+                stepBeams(req);
+            } else {
+                verify(req);
+            }
+            n_generated += req->result.n_generated - before;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.steps++;
+    stats_.promptTokens += n_prompt;
+    stats_.generatedTokens += n_generated;
+    stats_.decodeUs += t_decode;
+    if (n_decode > 0) {
+        stats_.maxDecodeStepUs = std::max(stats_.maxDecodeStepUs, t_decode);
+    }
+}
+
+bool BatchEngine::sample(const std::shared_ptr<Request>& req, int32_t idx) {
+    const llama_vocab* vocab = llama_model_get_vocab(model_.model);
+
+    const llama_token token = llama_sampler_sample(req->sampler, model_.ctx, idx);
+    if (llama_vocab_is_eog(vocab, token)) {
+        finish(req);
+        return false;
+    }
+
+    char buf[256];
+    const int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, false);
+    if (n > 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        req->result.text.append(buf, n);
+        if (req->stream) {
+            req->pending.append(buf, n);
+            req->cv.notify_all();
+            req->streamed = true;
+        }
+    }
+
+    req->next = token;
+    req->tokens.push_back(token);
+    req->result.n_generated++;
+
+    // Running into the end of the context is left to the next step, which
+    // can shift it
+    if (req->result.n_generated >= req->maxTokens) {
+        finish(req);
+        return false;
+    }
+    return true;
+}
+
+void BatchEngine::draftFor(Request& req, int32_t room) {
+    const int32_t n_ctx = (int32_t) llama_n_ctx(model_.ctx);
+
+    // Extra branches need sequences nobody else holds this step
+    while ((int) req.branchSeqs.size() + 1 < req.maxBranches) {
+        llama_seq_id seq = model_.acquireSeq();
+        if (seq < 0) {
+            break;
+        }
+        req.branchSeqs.push_back(seq);
+    }
+
+    const int n_branches = 1 + (int) req.branchSeqs.size();
+    const int32_t n_max = std::min({req.draftLength.get(), room / n_branches, n_ctx - req.pos() - 2});
+    if (n_max > 0) {
+        req.draft->draftTree(req.tokens, n_max, n_branches, req.tree);
+    }
+
+    // Return what the tree does not use; the rest share the committed cells
+    while ((int) req.branchSeqs.size() > std::max(0, req.tree.n_branches - 1)) {
+        model_.releaseSeq(req.branchSeqs.back());
+        req.branchSeqs.pop_back();
+    }
+    llama_memory_t mem = llama_get_memory(model_.ctx);
+    for (llama_seq_id seq : req.branchSeqs) {
+        llama_memory_seq_cp(mem, req.seq, seq, -1, -1);
+    }
+}
+
+void BatchEngine::releaseBranches(Request& req) {
+    for (llama_seq_id seq : req.branchSeqs) {
+        model_.releaseSeq(seq);
+    }
+    req.branchSeqs.clear();
+}
+
+void BatchEngine::verify(const std::shared_ptr<Request>& req) {
+    // The target samples after `next` and then after each tree node it
+    // picked. A picked node is already in the KV cache and its row is valid,
+    // so the walk continues until the sample matches no child.
+    const DraftTree& tree = req->tree;
+    const llama_pos draftPos = req->pos(); // position of the first drafted token
+    uint32_t alive = (1u << tree.n_branches) - 1;
+    int node = -1;
+    int n_accepted = 0;
+    int n_depth = 0;
+    DraftKind acceptedKind = DRAFT_NONE;
+
+    int32_t idx = req->logitsIdx;
+    while (sample(req, idx)) {
+        const int c = tree.child(node, req->next, alive);
+        if (c < 0) {
+            break;
+        }
+        node = c;
+        alive &= tree.nodes[c].branches;
+        acceptedKind = tree.nodes[c].kind;
+        n_accepted++;
+        req->n_past++;
+        idx = req->nodeIdx[c];
+    }
+
+    if (tree.nodes.empty()) {
+        return;
+    }
+
+    if (req->seq >= 0) {
+        // Commit the accepted path to the request's own sequence. Other
+        // requests share the context, so the losing branches are dropped by
+        // sequence rather than with llama_memory_seq_keep.
+        llama_memory_t mem = llama_get_memory(model_.ctx);
+        int winner = 0;
+        while (n_accepted > 0 && !(alive & (1u << winner))) {
+            winner++;
+        }
+        if (winner == 0) {
+            llama_memory_seq_rm(mem, req->seq, req->pos(), -1);
+        } else {
+            llama_memory_seq_rm(mem, req->seq, draftPos, -1);
+            llama_memory_seq_cp(mem, req->branchSeqs[winner - 1], req->seq, draftPos, req->pos());
+        }
+    }
+    releaseBranches(*req);
+
+    uint64_t drafted[DRAFT_KIND_COUNT] = {};
+    for (const auto& n : tree.nodes) {
+        drafted[n.kind]++;
+        n_depth = std::max(n_depth, n.depth + 1);
+    }
+    req->draftLength.update(n_depth, n_accepted);
+    req->n_drafted += (int) tree.nodes.size();
+    req->n_accepted += n_accepted;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int kind = 0; kind < DRAFT_KIND_COUNT; kind++) {
+        if (drafted[kind] > 0) {
+            stats_.speculation[kind].steps++;
+            stats_.speculation[kind].drafted += drafted[kind];
+        }
+    }
+    if (acceptedKind != DRAFT_NONE) {
+        stats_.speculation[acceptedKind].accepted += n_accepted;
+    }
+}
+
+void BatchEngine::stepBeams(const std::shared_ptr<Request>& req) {
+    const llama_vocab* vocab = llama_model_get_vocab(model_.model);
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    const size_t width = (size_t) req->beamWidth;
+
+    if (req->beams.empty()) {
+        // The prompt's logits row is the parent of the first beams
+        Request::Beam root;
+        root.seq = req->seq;
+        root.logitsIdx = req->logitsIdx;
+        req->beams.push_back(root);
+    }
+
+    // Every beam proposes its best `width` continuations, which is enough
+    // to fill all `width` places even if one beam wins them all
+    struct Candidate {
+        size_t parent;
+        llama_token token;
+        double logprob;
+    };
+    std::vector<Candidate> candidates;
+    std::vector<std::pair<float, llama_token>> top;
+    for (size_t b = 0; b < req->beams.size(); b++) {
+        const Request::Beam& beam = req->beams[b];
+        topLogProbs(llama_get_logits_ith(model_.ctx, beam.logitsIdx), n_vocab, width, top);
+        for (const auto& t : top) {
+            candidates.push_back({b, t.second, beam.logprob + t.first});
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Candidate& a, const Candidate& b) { return a.logprob > b.logprob; });
+
+    std::vector<Request::Beam> next;
+    std::vector<size_t> parents;
+    for (const Candidate& c : candidates) {
+        if (next.size() >= width || req->finished.size() >= width) {
+            break;
+        }
+        Request::Beam beam;
+        beam.tokens = req->beams[c.parent].tokens;
+        beam.logprob = c.logprob;
+        if (llama_vocab_is_eog(vocab, c.token)) {
+            req->finished.push_back(std::move(beam));
+            continue;
+        }
+        beam.tokens.push_back(c.token);
+        if ((int) beam.tokens.size() >= req->maxTokens) {
+            req->finished.push_back(std::move(beam));
+            continue;
+        }
+        next.push_back(std::move(beam));
+        parents.push_back(c.parent);
+    }
+
+    // Log-probabilities only fall as beams grow, so a live beam scoring
+    // below the best finished one can never overtake it
+    double bestFinished = -INFINITY;
+    for (const auto& beam : req->finished) {
+        bestFinished = std::max(bestFinished, beam.logprob);
+    }
+    if (next.empty() || req->finished.size() >= width || next.front().logprob <= bestFinished) {
+        req->beams = std::move(next);
+        finish(req);
+        return;
+    }
+
+    // The first child of a beam takes over its sequence. Other children get
+    // a copy of their parent's sequence, made in the sequence of a beam that
+    // left no children or in a newly borrowed one. Other requests share the
+    // context, so this uses llama_memory_seq_rm and seq_cp per sequence
+    // rather than llama_memory_seq_keep.
+    std::vector<bool> inherited(req->beams.size(), false);
+    for (size_t j = 0; j < next.size(); j++) {
+        if (!inherited[parents[j]]) {
+            inherited[parents[j]] = true;
+            next[j].seq = req->beams[parents[j]].seq;
+        }
+    }
+    std::vector<llama_seq_id> spare;
+    for (size_t b = 0; b < req->beams.size(); b++) {
+        if (!inherited[b]) {
+            spare.push_back(req->beams[b].seq);
+        }
+    }
+
+    llama_memory_t mem = llama_get_memory(model_.ctx);
+    for (size_t j = 0; j < next.size(); j++) {
+        if (next[j].seq >= 0) {
+            continue;
+        }
+        llama_seq_id seq = -1;
+        if (!spare.empty()) {
+            seq = spare.back();
+            spare.pop_back();
+        } else if ((seq = model_.acquireSeq()) >= 0) {
+            req->beamSeqs.push_back(seq);
+        } else {
+            continue; // no sequence left; the beam is dropped below
+        }
+        llama_memory_seq_rm(mem, seq, -1, -1);
+        llama_memory_seq_cp(mem, req->beams[parents[j]].seq, seq, -1, -1);
+        next[j].seq = seq;
+    }
+    next.erase(std::remove_if(next.begin(), next.end(), [](const Request::Beam& b) { return b.seq < 0; }),
+               next.end());
+
+    for (llama_seq_id seq : spare) {
+        if (seq == req->seq) {
+            llama_memory_seq_rm(mem, seq, -1, -1);
+        } else {
+            model_.releaseSeq(seq);
+            req->beamSeqs.erase(std::remove(req->beamSeqs.begin(), req->beamSeqs.end(), seq), req->beamSeqs.end());
+        }
+    }
+    req->beams = std::move(next);
+}
+
+void BatchEngine::releaseBeams(Request& req) {
+    for (llama_seq_id seq : req.beamSeqs) {
+        model_.releaseSeq(seq);
+    }
+    req.beamSeqs.clear();
+    req.beams.clear();
+    req.finished.clear();
+}
+
+void BatchEngine::finish(const std::shared_ptr<Request>& req, const std::string& error) {
+    model_.releaseSeq(req->seq);
+    req->seq = -1;
+    releaseBranches(*req);
+    req->draft.reset();
+
+    if (req->beamWidth > 0) {
+        // The best finished hypothesis wins; live beams only count when
+        // none finished, e.g. when the context ran out
+        const std::vector<Request::Beam>& pool = req->finished.empty() ? req->beams : req->finished;
+        const Request::Beam* best = nullptr;
+        for (const auto& beam : pool) {
+            if (!best || beam.logprob > best->logprob) {
+                best = &beam;
+            }
+        }
+        if (best && error.empty()) {
+            const llama_vocab* vocab = llama_model_get_vocab(model_.model);
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (llama_token token : best->tokens) {
+                char buf[256];
+                const int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, false);
+                if (n > 0) {
+                    req->result.text.append(buf, n);
+                }
+            }
+            req->result.n_generated = (int) best->tokens.size();
+            req->tokens.insert(req->tokens.end(), best->tokens.begin(), best->tokens.end());
+        }
+        releaseBeams(*req);
+    }
+
+    if (error.empty() && req->ngramCache) {
+        // Include a little prompt so the first generated tokens have context
+        const size_t start = req->n_prompt - std::min<size_t>(req->n_prompt, NgramCache::CONTEXT_MAX);
+        req->ngramCache->update(req->tokens.data() + start, req->tokens.size() - start);
+    }
+    active_.erase(std::remove(active_.begin(), active_.end(), req), active_.end());
+    admitPaused_ = false;
+
+    const double t_ms = (llama_time_us() - req->t_start) / 1000.0;
+    LOGI("Engine request done: %d prompt tokens, %d generated in %.1f ms (%.1f tok/s), %zu still active",
+         req->result.n_prompt, req->result.n_generated, t_ms,
+         t_ms > 0 ? req->result.n_generated * 1000.0 / t_ms : 0.0, active_.size());
+    if (req->n_drafted > 0) {
+        LOGI("Speculation accepted %d of %d drafted tokens (%.0f%%)", req->n_accepted, req->n_drafted,
+             100.0 * req->n_accepted / req->n_drafted);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    complete(*req, error);
+}
+
+void BatchEngine::complete(Request& req, const std::string& error) {
+    req.result.error = error;
+    req.done = true;
+    req.cv.notify_all();
+    stats_.requests++;
+
+    // Completions still waiting for this prefill share its fate
+    for (auto& fork : req.forks) {
+        complete(*fork, error.empty() ? "prompt was not prefilled" : error);
+    }
+    req.forks.clear();
+}
+
+bool BatchEngine::shift(Request& req, int n_tokens) {
+    const ModelConfig& config = model_.config;
+    const int n_kv = req.pos();
+    const int n_keep = std::min(n_kv, std::max(0, config.n_keep));
+    if (!config.context_shift || req.prefilling() || req.seq < 0 || req.beamWidth > 0 || n_keep + n_tokens >= n_kv) {
+        return false;
+    }
+
+    const int n_discard = std::max(n_tokens, contextShiftDiscard(n_kv, n_keep));
+    if (!shiftContext(model_.ctx, req.seq, n_kv, n_keep, n_discard)) {
+        return false;
+    }
+    req.n_shifted += (size_t) std::min(n_discard, n_kv - n_keep);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.contextShifts++;
+    return true;
+}
+
+bool BatchEngine::shiftLongest() {
+    std::shared_ptr<Request> longest;
+    for (const auto& req : active_) {
+        if (!req->prefilling() && (!longest || req->pos() > longest->pos())) {
+            longest = req;
+        }
+    }
+    return longest && shift(*longest, 1);
+}
+
+void BatchEngine::preemptNewest() {
+    std::shared_ptr<Request> req = active_.back();
+    if (active_.size() == 1 || req->streamed) {
+        // Shifting some generating sequence frees cells and keeps everyone going
+        if (!shiftLongest()) {
+            finish(req, prefillStatusMessage(PREFILL_CONTEXT_FULL));
+        }
+        return;
+    }
+
+    // Nothing was returned yet, so the newest request can start over once
+    // another one finishes and frees its cells
+    LOGI("Engine context full, requeueing request on seq %d", req->seq);
+    model_.releaseSeq(req->seq);
+    req->seq = -1;
+    releaseBeams(*req);
+    req->n_past = 0;
+    req->n_shifted = 0;
+    req->tokens.resize(req->n_prompt);
+    req->result.text.clear();
+    req->result.n_generated = 0;
+    if (req->sampler) {
+        llama_sampler_reset(req->sampler);
+    }
+    active_.pop_back();
+    admitPaused_ = true;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_front(req);
+}
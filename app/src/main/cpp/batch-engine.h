@@ -0,0 +1,174 @@
+#pragma once
+
+#include "llama.h"
+#include "request-handle.h"
+#include "speculative.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct LoadedModel;
+class NgramCache;
+
+// Speculative decoding for every request of an engine
+struct SpeculativeConfig {
+    // Drafts copied from earlier in the prompt and output; needs no second model
+    bool promptLookup = false;
+
+    // Persistent table learned from earlier generations, asked when prompt
+    // lookup finds nothing. Every finished request is added to it.
+    std::shared_ptr<NgramCache> ngramCache;
+
+    // Small model of the target's family that drafts tokens, or null. Only
+    // asked when prompt lookup has nothing.
+    std::shared_ptr<LoadedModel> draftModel;
+    int n_draft_min = 2;
+    int n_draft_max = 8;
+
+    // Drafts verified together as a token tree; 1 keeps a single chain.
+    // Each extra branch borrows a free sequence id for the step.
+    int maxBranches = 1;
+};
+
+struct EngineResult {
+    std::string text;  // generated text, without the prompt
+    std::string error; // empty on success
+    int n_prompt = 0;
+    int n_generated = 0;
+};
+
+// Continuous batching over a model's shared context. Requests wait in a
+// queue until a sequence id is free, then join the running set between
+// steps. Each step packs every active sequence into one llama_batch: the
+// next prompt tokens of sequences still prefilling and the last sampled
+// token of the others, each with its own logits row. Sequences leave as
+// soon as they finish, so one slow request does not hold the others back
+// and throughput grows with the number of concurrent requests.
+//
+// While any sequence is generating, a step holds at most the step token
+// budget: decode tokens first, then prompt tokens in the space left. A long
+// prompt is therefore prefilled over several steps, piggybacking on the
+// decode steps of the other requests, instead of stalling them for one
+// huge batch. With nobody generating, prompts get the whole n_batch.
+//
+// A generating sequence that reaches the end of the context, or a full KV
+// cache that has no newer request to preempt, is context shifted (see
+// context-shift.h) when the model config allows it, so long generations go
+// on at a constant memory cost instead of stopping.
+class BatchEngine {
+public:
+    using PieceFn = std::function<void(const char*, size_t)>;
+
+    struct Stats {
+        uint64_t steps = 0;
+        uint64_t requests = 0;
+        uint64_t promptTokens = 0;
+        uint64_t generatedTokens = 0;
+        int64_t decodeUs = 0;        // time spent in llama_decode
+        int64_t maxDecodeStepUs = 0; // slowest step that carried decode tokens, i.e. worst inter-token gap
+        uint64_t contextShifts = 0;  // times a full sequence dropped its oldest tokens to continue
+
+        // Per draft kind: verification passes, tokens drafted and tokens accepted
+        struct Speculation {
+            uint64_t steps = 0;
+            uint64_t drafted = 0;
+            uint64_t accepted = 0;
+        };
+        Speculation speculation[DRAFT_KIND_COUNT];
+    };
+
+    explicit BatchEngine(LoadedModel& model);
+    ~BatchEngine();
+
+    BatchEngine(const BatchEngine&) = delete;
+    BatchEngine& operator=(const BatchEngine&) = delete;
+
+    // Queues a completion of `prompt` and blocks until it is done. onPiece,
+    // if set, runs on the calling thread as text arrives, so it may call
+    // into the JVM. Once `cancel` expires the request stops within one graph
+    // node and its sequence is freed for the queue.
+    EngineResult generate(const std::string& prompt, int maxTokens, const PieceFn& onPiece = nullptr,
+                          std::shared_ptr<CancelToken> cancel = nullptr);
+
+    // `n` independent completions of one prompt. The prompt is prefilled
+    // once, then its KV cells are shared with n - 1 more sequences through
+    // llama_memory_seq_cp, and all of them decode together in each step.
+    // Each completion has its own clone of the sampler with its own seed.
+    std::vector<EngineResult> generateN(const std::string& prompt, int n, int maxTokens,
+                                        std::shared_ptr<CancelToken> cancel = nullptr);
+
+    // Deterministic completion by beam search, for short outputs such as
+    // titles, labels and translations. Each beam is a sequence of the shared
+    // context and all of them decode in the same step, scored by their
+    // cumulative log-probability. Beams beyond the free sequences are dropped.
+    EngineResult generateBeam(const std::string& prompt, int beamWidth, int maxTokens,
+                              std::shared_ptr<CancelToken> cancel = nullptr);
+
+    Stats stats();
+
+    // Tokens per step while some sequence is generating. Lower values bound
+    // inter-token latency more tightly but prefill long prompts more slowly.
+    void setStepBudget(int tokens);
+    int stepBudget() const { return stepBudget_.load(); }
+
+    // Applies to requests admitted from now on. Returns false, leaving the
+    // current setting, if the draft model's vocabulary does not match or its
+    // chain of draft models leads back to this model.
+    bool setSpeculation(const SpeculativeConfig& config);
+    SpeculativeConfig speculation();
+
+private:
+    struct Request;
+
+    // Returns an error message, or "" if the prompt can run
+    std::string checkPrompt(const std::vector<llama_token>& tokens) const;
+    // Queues `req` and starts the engine thread; false if the engine is stopping. Call with mutex_ held.
+    bool submit(const std::shared_ptr<Request>& req);
+
+    void run();
+    void admit();
+    void setUpDraft(Request& req, const SpeculativeConfig& speculation);
+    // Starts the completions waiting on `req`'s freshly prefilled prompt; returns those now active
+    std::vector<std::shared_ptr<Request>> fork(const std::shared_ptr<Request>& req);
+    void dropCancelled();
+    void step();
+    bool sample(const std::shared_ptr<Request>& req, int32_t idx);
+    void draftFor(Request& req, int32_t room);
+    void verify(const std::shared_ptr<Request>& req);
+    // Extends the beams of `req` from this step's logits and keeps the best
+    void stepBeams(const std::shared_ptr<Request>& req);
+    void releaseBeams(Request& req);
+    void releaseBranches(Request& req);
+    void finish(const std::shared_ptr<Request>& req, const std::string& error = "");
+    // Hands the result to the caller. Call with mutex_ held.
+    void complete(Request& req, const std::string& error);
+    void preemptNewest();
+
+    // Context shift of a generating request that makes room for `n_tokens`
+    // more; false if shifting is off or impossible
+    bool shift(Request& req, int n_tokens);
+    bool shiftLongest();
+
+    LoadedModel& model_;
+    llama_batch batch_;
+    std::atomic<int> stepBudget_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::shared_ptr<Request>> queue_;
+    bool stopping_ = false;
+    Stats stats_;
+    SpeculativeConfig speculation_;
+    std::thread thread_;
+
+    // Owned by the engine thread
+    std::vector<std::shared_ptr<Request>> active_;
+    bool admitPaused_ = false; // set after a preemption until a request finishes
+};
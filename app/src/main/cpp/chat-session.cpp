@@ -0,0 +1,479 @@
+#include "chat-session.h"
+#include "baked-prompts.h"
+#include "batch-engine.h"
+#include "context-shift.h"
+#include "native-log.h"
+#include "prefill.h"
+#include <algorithm>
+#include <thread>
+
+ChatSession::ChatSession(std::shared_ptr<LoadedModel> model, llama_seq_id seq)
+        : model_(std::move(model)), seq_(seq), modelHash_(modelHashFromStorePath(model_->path)) {
+    llama_sampler_chain_params sparams = llama_sampler_chain_default_params();
+    sampler_ = llama_sampler_chain_init(sparams);
+    llama_sampler_chain_add(sampler_, llama_sampler_init_top_k(40));
+    llama_sampler_chain_add(sampler_, llama_sampler_init_top_p(0.9f, 1));
+    llama_sampler_chain_add(sampler_, llama_sampler_init_temp(0.8f));
+    llama_sampler_chain_add(sampler_, llama_sampler_init_dist(1337));
+}
+
+ChatSession::~ChatSession() {
+    llama_sampler_free(sampler_);
+
+    std::lock_guard<std::mutex> lock(model_->mutex);
+    model_->releaseSeq(seq_);
+}
+
+std::string formatChatMessages(const llama_model* model, const std::vector<ChatMessage>& messages, bool addAssistant) {
+    std::vector<llama_chat_message> chat;
+    chat.reserve(messages.size());
+    for (const auto& message : messages) {
+        chat.push_back({message.role.c_str(), message.content.c_str()});
+    }
+
+    const char* tmpl = llama_model_chat_template(model, nullptr);
+    if (tmpl) {
+        std::vector<char> buf(1024);
+        int32_t n = llama_chat_apply_template(tmpl, chat.data(), chat.size(), addAssistant, buf.data(), (int32_t) buf.size());
+        if (n > (int32_t) buf.size()) {
+            buf.resize(n);
+            n = llama_chat_apply_template(tmpl, chat.data(), chat.size(), addAssistant, buf.data(), (int32_t) buf.size());
+        }
+        if (n >= 0) {
+            return std::string(buf.data(), n);
+        }
+        LOGE("Unsupported chat template, using plain format");
+    }
+
+    // Same plain format as generateMultimodal()
+    std::string text;
+    for (const auto& message : messages) {
+        if (message.role == "system") {
+            text += message.content + "\n";
+        } else {
+            text += (message.role == "user" ? "User: " : "Assistant: ") + message.content + "\n";
+        }
+    }
+    if (addAssistant) {
+        text += "Assistant:";
+    }
+    return text;
+}
+
+std::string ChatSession::formatChat(bool addAssistant) const {
+    return formatChatMessages(model_->model, messages_, addAssistant);
+}
+
+void ChatSession::syncCache() {
+    llama_memory_t mem = llama_get_memory(model_->ctx);
+    const size_t n_cached = (size_t) (llama_memory_seq_pos_max(mem, seq_) + 1);
+
+    if (n_cached > tokens_.size()) {
+        llama_memory_seq_rm(mem, seq_, (llama_pos) tokens_.size(), -1);
+    } else if (n_cached < tokens_.size()) {
+        // Cells went missing; the lost tail is re-prefilled from the text
+        LOGI("Session cache lost %zu tokens, re-prefilling", tokens_.size() - n_cached);
+        tokens_.clear();
+        cachedText_.clear();
+        llama_memory_seq_rm(mem, seq_, -1, -1);
+    }
+}
+
+std::string ChatSession::send(const std::string& userMessage, int maxTokens, const PieceFn& onPiece) {
+    std::lock_guard<std::mutex> turn(turnMutex_);
+    std::unique_lock<std::mutex> lock(model_->mutex);
+    ensureRestored();
+
+    messages_.push_back({"user", userMessage});
+    std::string reply = replyToHistory(lock, maxTokens, onPiece);
+    if (reply.rfind("Error:", 0) == 0) {
+        messages_.pop_back();
+    }
+    return reply;
+}
+
+std::string ChatSession::regenerate(int maxTokens, const PieceFn& onPiece) {
+    std::lock_guard<std::mutex> turn(turnMutex_);
+    std::unique_lock<std::mutex> lock(model_->mutex);
+    ensureRestored();
+
+    if (messages_.empty()) {
+        return "Error: Nothing to regenerate";
+    }
+    if (messages_.back().role == "assistant") {
+        messages_.pop_back();
+    }
+    return replyToHistory(lock, maxTokens, onPiece);
+}
+
+std::string ChatSession::editMessage(size_t index, const std::string& content, int maxTokens,
+                                     const PieceFn& onPiece) {
+    std::lock_guard<std::mutex> turn(turnMutex_);
+    std::unique_lock<std::mutex> lock(model_->mutex);
+    ensureRestored();
+
+    if (index >= messages_.size() || messages_[index].role != "user") {
+        return "Error: No user message at that index";
+    }
+    messages_.resize(index + 1);
+    messages_[index].content = content;
+    return replyToHistory(lock, maxTokens, onPiece);
+}
+
+std::string ChatSession::replyToHistory(std::unique_lock<std::mutex>& lock, int maxTokens, const PieceFn& onPiece) {
+    std::string prompt = formatChat(true);
+
+    syncCache();
+
+    // A new turn on a prefix-stable template only appends text; edits and
+    // regenerations diverge somewhere inside the cached history
+    bool ok;
+    if (!cachedText_.empty() && prompt.size() > cachedText_.size() &&
+        prompt.compare(0, cachedText_.size(), cachedText_) == 0) {
+        ok = appendText(lock, prompt.substr(cachedText_.size()));
+    } else {
+        ok = resyncTo(lock, prompt);
+    }
+    if (!ok) {
+        return "Error: " + lastError_;
+    }
+
+    std::string reply = generateReply(lock, maxTokens, onPiece);
+    messages_.push_back({"assistant", reply});
+    saveSnapshot();
+    return reply;
+}
+
+std::vector<ChatMessage> ChatSession::history() {
+    std::lock_guard<std::mutex> turn(turnMutex_);
+    std::lock_guard<std::mutex> lock(model_->mutex);
+    ensureRestored();
+    return messages_;
+}
+
+void ChatSession::setSnapshotPath(const std::string& path) {
+    std::lock_guard<std::mutex> turn(turnMutex_);
+    std::lock_guard<std::mutex> lock(model_->mutex);
+    snapshotPath_ = path;
+}
+
+void ChatSession::restoreFrom(const std::string& path) {
+    std::lock_guard<std::mutex> turn(turnMutex_);
+    std::lock_guard<std::mutex> lock(model_->mutex);
+    pendingRestore_ = path;
+}
+
+void ChatSession::ensureRestored() {
+    if (pendingRestore_.empty()) {
+        return;
+    }
+    const std::string path = std::move(pendingRestore_);
+    pendingRestore_.clear();
+
+    // A snapshot still queued for this path must land before it is read back
+    SnapshotWriter::instance().flush();
+
+    SessionSnapshot snapshot;
+    if (!readSnapshotFile(path, snapshot)) {
+        return;
+    }
+
+    messages_ = std::move(snapshot.messages);
+    applySnapshotState(snapshot);
+}
+
+bool ChatSession::applySnapshotState(SessionSnapshot& snapshot) {
+    tokens_.clear();
+    cachedText_.clear();
+
+    llama_memory_t mem = llama_get_memory(model_->ctx);
+    llama_memory_seq_rm(mem, seq_, -1, -1);
+
+    // Only a model installed by ModelStore has a content hash to match against
+    if (modelHash_.empty() || snapshot.modelHash != modelHash_) {
+        LOGI("Snapshot was taken with another model, history will be re-prefilled");
+        return false;
+    }
+
+    const int64_t t_start = llama_time_us();
+    if (!snapshot.state.empty() &&
+        llama_state_seq_set_data(model_->ctx, snapshot.state.data(), snapshot.state.size(), seq_) > 0) {
+        tokens_ = std::move(snapshot.tokens);
+        cachedText_ = std::move(snapshot.cachedText);
+        LOGI("Restored %zu cached tokens in %.1f ms", tokens_.size(), (llama_time_us() - t_start) / 1000.0);
+        return true;
+    }
+
+    LOGE("Failed to apply snapshot state, history will be re-prefilled");
+    llama_memory_seq_rm(mem, seq_, -1, -1);
+    return false;
+}
+
+void ChatSession::setSystemPrompt(const std::string& prompt) {
+    std::lock_guard<std::mutex> turn(turnMutex_);
+    std::lock_guard<std::mutex> lock(model_->mutex);
+    messages_.clear();
+    messages_.push_back({"system", prompt});
+}
+
+bool ChatSession::preloadPrefix(SessionSnapshot snapshot) {
+    std::lock_guard<std::mutex> turn(turnMutex_);
+    std::lock_guard<std::mutex> lock(model_->mutex);
+
+    // Only usable if it was baked from exactly the history this session starts with
+    if (!tokens_.empty() || snapshot.messages.size() != messages_.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < messages_.size(); i++) {
+        if (snapshot.messages[i].role != messages_[i].role || snapshot.messages[i].content != messages_[i].content) {
+            return false;
+        }
+    }
+    return applySnapshotState(snapshot);
+}
+
+void ChatSession::saveSnapshot() {
+    if (snapshotPath_.empty()) {
+        return;
+    }
+
+    // Copying the sequence state is a memcpy; the file write happens on the writer thread
+    SessionSnapshot snapshot;
+    snapshot.modelHash = modelHash_;
+    snapshot.messages = messages_;
+    snapshot.cachedText = cachedText_;
+    snapshot.tokens = tokens_;
+    snapshot.state.resize(llama_state_seq_get_size(model_->ctx, seq_));
+    const size_t n = llama_state_seq_get_data(model_->ctx, snapshot.state.data(), snapshot.state.size(), seq_);
+    snapshot.state.resize(n);
+
+    SnapshotWriter::instance().enqueue(snapshotPath_, std::move(snapshot));
+}
+
+bool ChatSession::resyncTo(std::unique_lock<std::mutex>& lock, const std::string& prompt) {
+    llama_memory_t mem = llama_get_memory(model_->ctx);
+    const llama_vocab* vocab = llama_model_get_vocab(model_->model);
+
+    std::vector<llama_token> tokens = tokenizeText(vocab, prompt, true, true);
+
+    // A history longer than the context loses its oldest turns the way a
+    // context shift would, keeping the sink tokens and the latest half
+    const size_t n_ctx = llama_n_ctx(model_->ctx);
+    const size_t n_keep = (size_t) std::max(0, model_->config.n_keep);
+    bool truncated = false;
+    while (model_->config.context_shift && tokens.size() >= n_ctx && tokens.size() > n_keep + 1) {
+        const size_t n_discard = std::max<size_t>(1, contextShiftDiscard((int) tokens.size(), (int) n_keep));
+        tokens.erase(tokens.begin() + n_keep, tokens.begin() + n_keep + n_discard);
+        truncated = true;
+    }
+    if (truncated) {
+        LOGI("Session history truncated to %zu tokens to fit the context", tokens.size());
+    }
+
+    size_t n_common = 0;
+    while (n_common < tokens.size() && n_common < tokens_.size() && tokens[n_common] == tokens_[n_common]) {
+        n_common++;
+    }
+    // At least one token must be decoded again to get logits for sampling
+    if (n_common == tokens.size() && n_common > 0) {
+        n_common--;
+    }
+
+    if (!llama_memory_seq_rm(mem, seq_, (llama_pos) n_common, -1)) {
+        // Partial removal is not supported by this memory type; start over
+        llama_memory_seq_rm(mem, seq_, -1, -1);
+        n_common = 0;
+    }
+
+    // A fresh or reset session can still start from a prefix another request cached
+    if (n_common == 0) {
+        n_common = model_->prefixCache->restore(model_->ctx, tokens, seq_);
+    }
+
+    LOGI("Session resync keeps %zu of %zu cached tokens, prefills %zu", n_common, tokens_.size(),
+         tokens.size() - n_common);
+
+    tokens_.assign(tokens.begin(), tokens.begin() + n_common);
+
+    PrefillStatus status = prefill(lock, tokens.data() + n_common, (int) (tokens.size() - n_common),
+                                   (llama_pos) n_common);
+    if (status != PREFILL_OK) {
+        lastError_ = prefillStatusMessage(status);
+        syncCache();
+        cachedText_.clear();
+        return false;
+    }
+
+    // A truncated history is no prefix that another prompt would start with
+    if (!truncated) {
+        model_->prefixCache->insert(model_->ctx, tokens.data(), tokens.size(), seq_);
+    }
+    tokens_ = std::move(tokens);
+    cachedText_ = prompt;
+    return true;
+}
+
+bool ChatSession::appendText(std::unique_lock<std::mutex>& lock, const std::string& text) {
+    const llama_vocab* vocab = llama_model_get_vocab(model_->model);
+    std::vector<llama_token> tokens = tokenizeText(vocab, text, tokens_.empty(), true);
+
+    if (!makeRoom(tokens.size())) {
+        lastError_ = prefillStatusMessage(PREFILL_CONTEXT_FULL);
+        return false;
+    }
+
+    PrefillStatus status = prefill(lock, tokens.data(), (int) tokens.size(), (llama_pos) tokens_.size());
+    if (status != PREFILL_OK) {
+        lastError_ = prefillStatusMessage(status);
+        syncCache();
+        return false;
+    }
+
+    LOGI("Session turn prefilled %zu new tokens on top of %zu cached", tokens.size(), tokens_.size());
+    tokens_.insert(tokens_.end(), tokens.begin(), tokens.end());
+    cachedText_ += text;
+    return true;
+}
+
+PrefillStatus ChatSession::prefill(std::unique_lock<std::mutex>& lock, const llama_token* tokens, int n_tokens,
+                                  llama_pos pos0) {
+    PrefillOptions options;
+    options.seq_id = seq_;
+    options.max_chunk = model_->engine->stepBudget();
+    options.betweenChunks = [&lock] {
+        lock.unlock();
+        std::this_thread::yield();
+        lock.lock();
+    };
+    return prefillTokens(model_->ctx, tokens, n_tokens, pos0, options);
+}
+
+bool ChatSession::makeRoom(size_t n_tokens) {
+    const size_t n_ctx = llama_n_ctx(model_->ctx);
+    if (tokens_.size() + n_tokens < n_ctx) {
+        return true;
+    }
+
+    const ModelConfig& config = model_->config;
+    const size_t n_keep = std::min(tokens_.size(), (size_t) std::max(0, config.n_keep));
+    if (!config.context_shift || n_keep + n_tokens >= n_ctx) {
+        return false;
+    }
+
+    // Drop at least what the new tokens need, usually half the history
+    const size_t n_needed = tokens_.size() + n_tokens + 1 - n_ctx;
+    const size_t n_discard = std::max(n_needed, (size_t) contextShiftDiscard((int) tokens_.size(), (int) n_keep));
+    if (!shiftContext(model_->ctx, seq_, (int) tokens_.size(), (int) n_keep, (int) n_discard)) {
+        return false;
+    }
+    tokens_.erase(tokens_.begin() + n_keep, tokens_.begin() + std::min(tokens_.size(), n_keep + n_discard));
+    return true;
+}
+
+std::string ChatSession::generateReply(std::unique_lock<std::mutex>& lock, int maxTokens, const PieceFn& onPiece) {
+    llama_context* ctx = model_->ctx;
+    const llama_vocab* vocab = llama_model_get_vocab(model_->model);
+
+    // Other users of the context decode while the lock is released, so each
+    // token is sampled in the same hold as the decode that produced its logits
+    std::string reply;
+    llama_token token = llama_sampler_sample(sampler_, ctx, -1);
+    for (int n_decode = 0; n_decode < maxTokens && !llama_vocab_is_eog(vocab, token); n_decode++) {
+        llama_sampler_accept(sampler_, token);
+
+        char buf[256];
+        int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, false);
+        if (n > 0) {
+            reply.append(buf, n);
+        }
+
+        lock.unlock();
+        if (onPiece && n > 0) {
+            onPiece(buf, n);
+        }
+        std::this_thread::yield();
+        lock.lock();
+
+        if (!makeRoom(1)) {
+            LOGI("Session context full, reply cut short");
+            break;
+        }
+        if (decodeToken(ctx, token, (llama_pos) tokens_.size(), seq_) != 0) {
+            LOGE("Failed to decode token");
+            break;
+        }
+        tokens_.push_back(token);
+        if (n > 0) {
+            cachedText_.append(buf, n);
+        }
+        if (n_decode + 1 < maxTokens) {
+            token = llama_sampler_sample(sampler_, ctx, -1);
+        }
+    }
+
+    return reply;
+}
+
+SessionManager& SessionManager::instance() {
+    static SessionManager manager;
+    return manager;
+}
+
+int64_t SessionManager::create(const std::string& modelPath) {
+    std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().acquire(modelPath);
+    if (!loaded) {
+        return 0;
+    }
+
+    // A session holds its sequence until closed; keep one free so the
+    // batching engine can still admit one-shot requests
+    std::lock_guard<std::mutex> lock(mutex_);
+    const int maxSessions = (int) llama_n_seq_max(loaded->ctx) - 1;
+    int n_open = 0;
+    for (const auto& entry : sessions_) {
+        n_open += entry.second->model() == loaded;
+    }
+    if (n_open >= maxSessions) {
+        LOGE("Too many open sessions for this model (%d of %d sequences)", n_open, maxSessions + 1);
+        return 0;
+    }
+
+    llama_seq_id seq = loaded->acquireSeq();
+    if (seq < 0) {
+        LOGE("No free sequence for a new session");
+        return 0;
+    }
+
+    const int64_t handle = nextHandle_++;
+    sessions_[handle] = std::make_shared<ChatSession>(loaded, seq);
+    return handle;
+}
+
+int64_t SessionManager::resume(const std::string& modelPath, const std::string& snapshotPath) {
+    const int64_t handle = create(modelPath);
+    if (std::shared_ptr<ChatSession> session = get(handle)) {
+        session->restoreFrom(snapshotPath);
+        session->setSnapshotPath(snapshotPath);
+    }
+    return handle;
+}
+
+std::shared_ptr<ChatSession> SessionManager::get(int64_t handle) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = sessions_.find(handle);
+    return it != sessions_.end() ? it->second : nullptr;
+}
+
+bool SessionManager::close(int64_t handle) {
+    std::shared_ptr<ChatSession> session;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = sessions_.find(handle);
+        if (it == sessions_.end()) {
+            return false;
+        }
+        session = std::move(it->second);
+        sessions_.erase(it);
+    }
+    return true;
+}
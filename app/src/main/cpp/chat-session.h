@@ -0,0 +1,148 @@
+#pragma once
+
+#include "model-registry.h"
+#include "prefill.h"
+#include "session-snapshot.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Formats `messages` with the model's chat template, or a plain
+// "User: ... Assistant:" layout if the model has none
+std::string formatChatMessages(const llama_model* model, const std::vector<ChatMessage>& messages, bool addAssistant);
+
+// One conversation whose KV cache stays in a dedicated sequence of the
+// model's shared context between turns. Each turn only prefills the text
+// added since the previous turn, so prefill cost tracks the new message
+// rather than the whole history.
+//
+// A turn takes the model mutex per prefill chunk of the engine's step
+// budget and per decoded token, not for the whole turn, and calls onPiece
+// without it, so the batching engine keeps stepping its own requests while
+// a session prefills or generates.
+class ChatSession {
+public:
+    using PieceFn = std::function<void(const char*, size_t)>;
+
+    ChatSession(std::shared_ptr<LoadedModel> model, llama_seq_id seq);
+    ~ChatSession();
+
+    ChatSession(const ChatSession&) = delete;
+    ChatSession& operator=(const ChatSession&) = delete;
+
+    // Adds a user message and generates the assistant reply
+    std::string send(const std::string& userMessage, int maxTokens = 512, const PieceFn& onPiece = nullptr);
+
+    // Drops the last assistant reply and generates a new one for the same history
+    std::string regenerate(int maxTokens = 512, const PieceFn& onPiece = nullptr);
+
+    // Replaces the user message at `index`, discards everything after it and
+    // generates a new reply. Only the tokens after the edit point are prefilled.
+    std::string editMessage(size_t index, const std::string& content, int maxTokens = 512,
+                            const PieceFn& onPiece = nullptr);
+
+    // Snapshots are written to `path` in the background after every completed turn
+    void setSnapshotPath(const std::string& path);
+
+    // Restores history and KV state from a snapshot the first time the session
+    // is used. If the KV state cannot be applied the history is re-prefilled.
+    void restoreFrom(const std::string& path);
+
+    std::vector<ChatMessage> history();
+
+    // Starts the conversation with a system message. Call before the first turn.
+    void setSystemPrompt(const std::string& prompt);
+
+    // Applies a prebuilt snapshot of the session's initial history (e.g. a
+    // baked system prompt) so the first turn skips prefilling it. Returns
+    // false if the snapshot does not match the current history.
+    bool preloadPrefix(SessionSnapshot snapshot);
+
+    // Tokens whose KV entries are held in the session's sequence
+    size_t cachedTokens() const { return tokens_.size(); }
+
+    const std::shared_ptr<LoadedModel>& model() const { return model_; }
+
+private:
+    std::string formatChat(bool addAssistant) const;
+
+    // Makes the KV sequence and tokens_ agree: trims cells past tokens_.size()
+    // and forgets tokens whose cells are gone. Call with the model mutex held.
+    void syncCache();
+
+    // Brings the cache to exactly `prompt`: keeps the longest common token prefix,
+    // removes the divergent tail with llama_memory_seq_rm and prefills the rest.
+    // Call with `lock` on the model mutex held.
+    bool resyncTo(std::unique_lock<std::mutex>& lock, const std::string& prompt);
+
+    // Prefills `text` after the cached tokens. Call with `lock` on the model mutex held.
+    bool appendText(std::unique_lock<std::mutex>& lock, const std::string& text);
+
+    // Decodes `tokens` at `pos0` of the session's sequence in chunks of the
+    // engine's step budget, releasing `lock` between chunks so a long prompt
+    // does not stall generating engine requests. Returns with `lock` held.
+    PrefillStatus prefill(std::unique_lock<std::mutex>& lock, const llama_token* tokens, int n_tokens,
+                          llama_pos pos0);
+
+    // Shifts the context if `n_tokens` more would not fit, dropping the
+    // oldest turns but the first config.n_keep tokens. Returns false if they
+    // cannot fit. Call with the model mutex held.
+    bool makeRoom(size_t n_tokens);
+
+    // Samples the reply from the logits of the session's last decode, which
+    // must have happened while `lock` was held. Releases `lock` around
+    // onPiece and between tokens; returns with it held.
+    std::string generateReply(std::unique_lock<std::mutex>& lock, int maxTokens, const PieceFn& onPiece);
+
+    // Formats the history, syncs the cache to it and generates the reply.
+    // Call with turnMutex_ and `lock` on the model mutex held.
+    std::string replyToHistory(std::unique_lock<std::mutex>& lock, int maxTokens, const PieceFn& onPiece);
+
+    // Call with the model mutex held
+    void ensureRestored();
+    void saveSnapshot();
+    bool applySnapshotState(SessionSnapshot& snapshot);
+
+    std::shared_ptr<LoadedModel> model_;
+    llama_seq_id seq_;
+
+    // Guards the session state below for a whole turn, while the model mutex
+    // is only held around each use of the context. Taken before the model mutex.
+    std::mutex turnMutex_;
+    std::string modelHash_; // ModelStore content hash, empty if the model is not a store blob
+    llama_sampler* sampler_ = nullptr;
+
+    std::vector<ChatMessage> messages_;
+    std::vector<llama_token> tokens_;
+    std::string cachedText_; // the text that tokens_ encodes, including what context shifts dropped
+    std::string lastError_;
+
+    std::string snapshotPath_;
+    std::string pendingRestore_;
+};
+
+// Owns the open chat sessions, addressed from Kotlin by opaque handles
+class SessionManager {
+public:
+    static SessionManager& instance();
+
+    // Returns 0 if the model cannot be loaded or has no free sequence. Sessions
+    // of one model are capped at n_seq_max - 1 so one-shot requests still run.
+    int64_t create(const std::string& modelPath);
+
+    // Like create(), restoring from and saving to `snapshotPath`
+    int64_t resume(const std::string& modelPath, const std::string& snapshotPath);
+    std::shared_ptr<ChatSession> get(int64_t handle);
+    bool close(int64_t handle);
+
+private:
+    SessionManager() = default;
+
+    std::mutex mutex_;
+    int64_t nextHandle_ = 1;
+    std::unordered_map<int64_t, std::shared_ptr<ChatSession>> sessions_;
+};
@@ -0,0 +1,156 @@
+#include "content-hash.h"
+#include "asset-mmap.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+inline uint64_t mergeRound64(uint64_t acc, uint64_t val) {
+    acc ^= round64(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+} // namespace
+
+uint64_t xxh64(const void* data, size_t size, uint64_t seed) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const uint8_t* end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        const uint8_t* limit = end - 32;
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        do {
+            v1 = round64(v1, read64(p)); p += 8;
+            v2 = round64(v2, read64(p)); p += 8;
+            v3 = round64(v3, read64(p)); p += 8;
+            v4 = round64(v4, read64(p)); p += 8;
+        } while (p <= limit);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = mergeRound64(h, v1);
+        h = mergeRound64(h, v2);
+        h = mergeRound64(h, v3);
+        h = mergeRound64(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+
+    h += (uint64_t) size;
+
+    while (p + 8 <= end) {
+        h ^= round64(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+std::string hashContent(const uint8_t* data, size_t size, int n_threads) {
+    const size_t n_chunks = std::max<size_t>(1, (size + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE);
+    std::vector<uint64_t> digests(n_chunks);
+
+    if (n_threads <= 0) {
+        n_threads = (int) std::max(1u, std::thread::hardware_concurrency());
+    }
+    n_threads = (int) std::min<size_t>((size_t) n_threads, n_chunks);
+
+    // Workers pull chunk indices from a shared counter so slow cores do not hold up the rest
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < n_chunks; i = next++) {
+            const size_t begin = i * HASH_CHUNK_SIZE;
+            const size_t len = std::min(HASH_CHUNK_SIZE, size - std::min(size, begin));
+            digests[i] = xxh64(data + begin, len, 0);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < n_threads; t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    return hashFromChunkDigests(digests, size);
+}
+
+std::string hashFromChunkDigests(const std::vector<uint64_t>& digests, uint64_t totalSize) {
+    // Seeding the root with the total size keeps e.g. trailing zero chunks distinguishable
+    uint64_t root = xxh64(digests.data(), digests.size() * sizeof(uint64_t), totalSize);
+
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) root);
+    return hex;
+}
+
+std::string hashFile(const std::string& path, int n_threads) {
+    FileRange range;
+    if (!openFileRange(path, 0, -1, range)) {
+        return "";
+    }
+    if (range.length == 0) {
+        return hashContent(nullptr, 0, 1);
+    }
+
+    MappedRegion mapped;
+    if (!mapped.map(range)) {
+        return "";
+    }
+    mapped.adviseSequential();
+    return hashContent(mapped.data(), mapped.size(), n_threads);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Chunk size of the hash tree used by hashContent()
+constexpr size_t HASH_CHUNK_SIZE = 8u << 20;
+
+// XXH64 of a single buffer
+uint64_t xxh64(const void* data, size_t size, uint64_t seed = 0);
+
+// Content hash of a large buffer. The input is split into fixed-size chunks
+// that are hashed with XXH64 on `n_threads` threads; the chunk digests are
+// then hashed together. Returns 16 lowercase hex digits.
+std::string hashContent(const uint8_t* data, size_t size, int n_threads = 0);
+
+// hashContent() over a whole file, read through a shared mapping.
+// Returns an empty string if the file cannot be mapped.
+std::string hashFile(const std::string& path, int n_threads = 0);
+
+// Root of the hash tree from per-chunk XXH64 digests (seed 0) of consecutive
+// HASH_CHUNK_SIZE chunks. Lets streaming writers hash data as it passes through.
+std::string hashFromChunkDigests(const std::vector<uint64_t>& digests, uint64_t totalSize);
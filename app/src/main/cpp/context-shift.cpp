@@ -0,0 +1,27 @@
+#include "context-shift.h"
+#include "native-log.h"
+#include <algorithm>
+
+bool shiftContext(llama_context* ctx, llama_seq_id seq, int n_past, int n_keep, int n_discard) {
+    n_keep = std::max(0, std::min(n_keep, n_past));
+    n_discard = std::min(n_discard, n_past - n_keep);
+    if (n_discard <= 0) {
+        return false;
+    }
+
+    llama_memory_t mem = llama_get_memory(ctx);
+    if (!llama_memory_can_shift(mem)) {
+        LOGI("Context shift not supported by this model's memory");
+        return false;
+    }
+
+    llama_memory_seq_rm(mem, seq, n_keep, n_keep + n_discard);
+    llama_memory_seq_add(mem, seq, n_keep + n_discard, n_past, -n_discard);
+
+    LOGI("Context shift on seq %d: kept %d, dropped %d, %d remain", seq, n_keep, n_discard, n_past - n_discard);
+    return true;
+}
+
+int contextShiftDiscard(int n_past, int n_keep) {
+    return std::max(0, n_past - n_keep) / 2;
+}
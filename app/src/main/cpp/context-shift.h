@@ -0,0 +1,17 @@
+#pragma once
+
+#include "llama.h"
+
+// Drops the oldest part of a full sequence so generation can go on at a
+// constant memory cost. The first `n_keep` tokens stay: models put a lot of
+// attention on the first positions (attention sinks), and losing them hurts
+// far more than losing the same number of tokens further in. The
+// `n_discard` tokens after them are removed and the rest move down, so the
+// sequence continues at n_past - n_discard.
+//
+// Returns false, leaving the cache untouched, if nothing can be dropped or
+// the memory cannot shift positions (e.g. recurrent models).
+bool shiftContext(llama_context* ctx, llama_seq_id seq, int n_past, int n_keep, int n_discard);
+
+// Half of what follows the kept tokens, so a shift buys room for many steps
+int contextShiftDiscard(int n_past, int n_keep);
@@ -0,0 +1,159 @@
+#include "embedding-engine.h"
+#include "model-registry.h"
+#include "native-log.h"
+#include "prefill.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+namespace {
+
+llama_context* createContext(llama_model* model, const EmbeddingConfig& config, enum llama_pooling_type pooling) {
+    llama_context_params params = llama_context_default_params();
+    params.embeddings = true;
+    params.pooling_type = pooling;
+    params.n_ctx = config.n_batch;
+    params.n_batch = config.n_batch;
+    // Pooling needs all of a sequence's tokens in one physical batch
+    params.n_ubatch = config.n_batch;
+    params.n_seq_max = config.n_seq_max;
+    params.n_threads = config.n_threads;
+    params.n_threads_batch = config.n_threads;
+    return llama_init_from_model(model, params);
+}
+
+void normalize(float* v, int n) {
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) {
+        sum += (double) v[i] * v[i];
+    }
+    const float scale = sum > 0.0 ? (float) (1.0 / std::sqrt(sum)) : 0.0f;
+    for (int i = 0; i < n; i++) {
+        v[i] *= scale;
+    }
+}
+
+} // namespace
+
+std::shared_ptr<EmbeddingEngine> EmbeddingEngine::attach(LoadedModel& model, const EmbeddingConfig& config) {
+    std::lock_guard<std::mutex> lock(model.mutex);
+    if (model.embedder && (config.pooling == LLAMA_POOLING_TYPE_UNSPECIFIED ||
+                           config.pooling == model.embedder->pooling())) {
+        return model.embedder;
+    }
+
+    llama_context* ctx = createContext(model.model, config, config.pooling);
+    if (ctx && llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_NONE) {
+        // A generative model has no pooling of its own; average its token states
+        llama_free(ctx);
+        ctx = createContext(model.model, config, LLAMA_POOLING_TYPE_MEAN);
+    }
+    if (!ctx) {
+        LOGE("Failed to create embedding context for: %s", model.path.c_str());
+        return nullptr;
+    }
+    if (llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_RANK) {
+        LOGE("Reranker models score pairs and do not produce embeddings: %s", model.path.c_str());
+        llama_free(ctx);
+        return nullptr;
+    }
+
+    model.embedder.reset(new EmbeddingEngine(model, ctx, config));
+    LOGI("Embedding engine ready: dimension %d, pooling %d", model.embedder->dimension(),
+         (int) model.embedder->pooling());
+    return model.embedder;
+}
+
+EmbeddingEngine::EmbeddingEngine(LoadedModel& model, llama_context* ctx, const EmbeddingConfig& config)
+    : model_(model), ctx_(ctx), config_(config) {
+    pooling_ = llama_pooling_type(ctx_);
+    n_embd_ = llama_model_n_embd(model_.model);
+    batch_ = llama_batch_init(config_.n_batch, 0, 1);
+}
+
+EmbeddingEngine::~EmbeddingEngine() {
+    llama_batch_free(batch_);
+    llama_free(ctx_);
+}
+
+bool EmbeddingEngine::embed(const std::vector<std::string>& texts, std::vector<float>& out) {
+    const llama_vocab* vocab = llama_model_get_vocab(model_.model);
+    const int64_t t_start = llama_time_us();
+
+    std::vector<std::vector<llama_token>> tokens(texts.size());
+    size_t n_truncated = 0;
+    for (size_t i = 0; i < texts.size(); i++) {
+        tokens[i] = tokenizeText(vocab, texts[i], true);
+        if (tokens[i].size() > (size_t) config_.n_batch) {
+            tokens[i].resize(config_.n_batch);
+            n_truncated++;
+        }
+    }
+    if (n_truncated > 0) {
+        LOGI("Truncated %zu texts to %d tokens for embedding", n_truncated, config_.n_batch);
+    }
+
+    // Longest first: the short texts at the end fill the gaps the long ones leave
+    std::vector<size_t> order(texts.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t a, size_t b) { return tokens[a].size() > tokens[b].size(); });
+
+    out.assign(texts.size() * (size_t) n_embd_, 0.0f);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    llama_memory_t mem = llama_get_memory(ctx_);
+
+    std::vector<size_t> rows; // text of each sequence id in the batch
+    size_t n_batches = 0;
+    size_t n_tokens = 0;
+    size_t next = 0;
+    while (next < order.size()) {
+        batch_.n_tokens = 0;
+        rows.clear();
+        while (next < order.size() && (int) rows.size() < config_.n_seq_max &&
+               batch_.n_tokens + (int32_t) tokens[order[next]].size() <= config_.n_batch) {
+            const std::vector<llama_token>& text = tokens[order[next]];
+            const llama_seq_id seq = (llama_seq_id) rows.size();
+            for (size_t t = 0; t < text.size(); t++) {
+                const int32_t i = batch_.n_tokens++;
+                batch_.token[i] = text[t];
+                batch_.pos[i] = (llama_pos) t;
+                batch_.n_seq_id[i] = 1;
+                batch_.seq_id[i][0] = seq;
+                batch_.logits[i] = true;
+            }
+            rows.push_back(order[next++]);
+        }
+
+        if (batch_.n_tokens > 0) {
+            // Sequence ids are reused by every batch; causal models keep them in the KV cache
+            if (mem) {
+                llama_memory_clear(mem, true);
+            }
+            if (llama_decode(ctx_, batch_) != 0) {
+                LOGE("Embedding decode failed");
+                return false;
+            }
+        }
+
+        for (size_t s = 0; s < rows.size(); s++) {
+            float* row = out.data() + rows[s] * (size_t) n_embd_;
+            const float* embd = tokens[rows[s]].empty() ? nullptr : llama_get_embeddings_seq(ctx_, (llama_seq_id) s);
+            if (!embd) {
+                continue; // empty text; its row stays zero
+            }
+            std::copy(embd, embd + n_embd_, row);
+            if (config_.normalize) {
+                normalize(row, n_embd_);
+            }
+        }
+        n_batches++;
+        n_tokens += (size_t) batch_.n_tokens;
+    }
+
+    const double t_ms = (llama_time_us() - t_start) / 1000.0;
+    LOGI("Embedded %zu texts (%zu tokens) in %zu batches, %.1f ms (%.1f texts/s)", texts.size(), n_tokens,
+         n_batches, t_ms, t_ms > 0 ? texts.size() * 1000.0 / t_ms : 0.0);
+    return true;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "llama.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct LoadedModel;
+
+struct EmbeddingConfig {
+    // LLAMA_POOLING_TYPE_UNSPECIFIED uses the model's own pooling, or mean
+    // pooling for models that have none (plain generative models)
+    enum llama_pooling_type pooling = LLAMA_POOLING_TYPE_UNSPECIFIED;
+    int n_batch = 2048;    // tokens per decode; longer texts are truncated to it
+    int n_seq_max = 64;    // texts per decode
+    int n_threads = 4;
+    bool normalize = true; // unit length, so a dot product is the cosine similarity
+};
+
+// Sentence embeddings from a second context over a loaded model's weights,
+// created with `embeddings = true`. Short texts are packed into one
+// llama_batch as separate sequences, longest first so batches stay full,
+// and each text's pooled vector is read with llama_get_embeddings_seq.
+class EmbeddingEngine {
+public:
+    // Returns the model's embedding engine, creating it (or replacing one
+    // with another pooling) on first use. Returns nullptr if the context
+    // cannot be created or the model cannot pool embeddings.
+    static std::shared_ptr<EmbeddingEngine> attach(LoadedModel& model, const EmbeddingConfig& config = EmbeddingConfig());
+
+    ~EmbeddingEngine();
+
+    EmbeddingEngine(const EmbeddingEngine&) = delete;
+    EmbeddingEngine& operator=(const EmbeddingEngine&) = delete;
+
+    int dimension() const { return n_embd_; }
+    enum llama_pooling_type pooling() const { return pooling_; }
+
+    // Fills `out` with texts.size() rows of dimension() floats, row i for
+    // text i. Returns false if a decode fails.
+    bool embed(const std::vector<std::string>& texts, std::vector<float>& out);
+
+private:
+    EmbeddingEngine(LoadedModel& model, llama_context* ctx, const EmbeddingConfig& config);
+
+    LoadedModel& model_;
+    llama_context* ctx_;
+    EmbeddingConfig config_;
+    enum llama_pooling_type pooling_;
+    int n_embd_;
+
+    std::mutex mutex_; // guards ctx_ and batch_
+    llama_batch batch_;
+};
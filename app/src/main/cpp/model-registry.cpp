@@ -0,0 +1,181 @@
+#include "model-registry.h"
+#include "batch-engine.h"
+#include "embedding-engine.h"
+#include "native-log.h"
+#include "prefill.h"
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+LoadedModel::~LoadedModel() {
+    // The engine thread uses ctx until it is joined
+    engine.reset();
+    embedder.reset();
+    if (ctx) {
+        llama_free(ctx);
+    }
+    if (model) {
+        llama_model_free(model);
+    }
+    LOGI("Model unloaded: %s", path.c_str());
+}
+
+llama_seq_id LoadedModel::acquireSeq() {
+    std::lock_guard<std::mutex> lock(seqMutex_);
+    if (seqUsed_.empty()) {
+        seqUsed_.resize(llama_n_seq_max(ctx), false);
+    }
+    for (size_t i = 0; i < seqUsed_.size(); i++) {
+        if (!seqUsed_[i]) {
+            seqUsed_[i] = true;
+            return (llama_seq_id) i;
+        }
+    }
+    return -1;
+}
+
+void LoadedModel::releaseSeq(llama_seq_id seq) {
+    if (seq < 0) {
+        return;
+    }
+    llama_memory_seq_rm(llama_get_memory(ctx), seq, -1, -1);
+
+    std::lock_guard<std::mutex> lock(seqMutex_);
+    if ((size_t) seq < seqUsed_.size()) {
+        seqUsed_[seq] = false;
+    }
+}
+
+ModelRegistry& ModelRegistry::instance() {
+    static ModelRegistry registry;
+    return registry;
+}
+
+std::shared_ptr<LoadedModel> ModelRegistry::acquire(const std::string& path, const ModelConfig& config) {
+    // Loading happens under the registry lock so concurrent callers never load the same file twice
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = models_.find(path);
+    if (it != models_.end()) {
+        return it->second;
+    }
+
+    LOGI("Loading model from: %s", path.c_str());
+
+    auto entry = std::make_shared<LoadedModel>();
+    entry->path = path;
+    entry->config = config;
+
+    // Load model
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = 0; // CPU only for mobile
+
+    entry->model = llama_model_load_from_file(path.c_str(), model_params);
+    if (!entry->model) {
+        LOGE("Failed to load model: %s", path.c_str());
+        return nullptr;
+    }
+
+    // Create context
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = config.n_ctx;
+    ctx_params.n_batch = config.n_batch;
+    ctx_params.n_ubatch = std::min(config.n_ubatch, config.n_batch);
+    ctx_params.n_seq_max = config.n_seq_max;
+    ctx_params.n_threads = config.n_threads;
+    ctx_params.n_threads_batch = config.n_threads;
+
+    entry->ctx = llama_init_from_model(entry->model, ctx_params);
+    if (!entry->ctx) {
+        LOGE("Failed to create context for: %s", path.c_str());
+        return nullptr;
+    }
+
+    llama_set_abort_callback(entry->ctx, [](void* data) {
+        LoadedModel* loaded = (LoadedModel*) data;
+        return loaded->abortCheck && loaded->abortCheck();
+    }, entry.get());
+
+    entry->prefixCache.reset(new PrefixCache(config.prefix_cache_bytes));
+    entry->engine.reset(new BatchEngine(*entry));
+
+    models_[path] = entry;
+    return entry;
+}
+
+bool ModelRegistry::unload(const std::string& path) {
+    std::shared_ptr<LoadedModel> entry;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = models_.find(path);
+        if (it == models_.end()) {
+            return false;
+        }
+        entry = std::move(it->second);
+        models_.erase(it);
+    }
+    // Freed here unless a generation call still holds a reference
+    return true;
+}
+
+void ModelRegistry::unloadAll() {
+    std::unordered_map<std::string, std::shared_ptr<LoadedModel>> models;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        models.swap(models_);
+    }
+}
+
+bool ModelRegistry::isLoaded(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return models_.count(path) > 0;
+}
+
+std::shared_ptr<LoadedModel> ModelRegistry::find(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = models_.find(path);
+    return it != models_.end() ? it->second : nullptr;
+}
+
+void ModelRegistry::warmUpAsync(const std::string& path, const ModelConfig& config) {
+    std::thread([this, path, config]() {
+        const int64_t t_start = llama_time_us();
+
+        std::shared_ptr<LoadedModel> loaded = acquire(path, config);
+        if (!loaded) {
+            LOGE("Warm-up skipped, model failed to load: %s", path.c_str());
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(loaded->mutex);
+        llama_context* ctx = loaded->ctx;
+        const llama_vocab* vocab = llama_model_get_vocab(loaded->model);
+
+        // Same token pair llama.cpp uses for its own warm-up run
+        std::vector<llama_token> tokens;
+        llama_token bos = llama_vocab_bos(vocab);
+        llama_token eos = llama_vocab_eos(vocab);
+        if (bos != LLAMA_TOKEN_NULL) tokens.push_back(bos);
+        if (eos != LLAMA_TOKEN_NULL) tokens.push_back(eos);
+        if (tokens.empty()) tokens.push_back(0);
+
+        llama_seq_id seq = loaded->acquireSeq();
+        if (seq < 0) {
+            return;
+        }
+
+        PrefillOptions options;
+        options.seq_id = seq;
+        options.logits_last = false;
+
+        llama_set_warmup(ctx, true);
+        if (prefillTokens(ctx, tokens.data(), (int) tokens.size(), 0, options) != PREFILL_OK) {
+            LOGE("Warm-up decode failed for: %s", path.c_str());
+        }
+        llama_synchronize(ctx);
+        llama_set_warmup(ctx, false);
+        loaded->releaseSeq(seq);
+
+        LOGI("Warm-up finished in %.1f ms: %s", (llama_time_us() - t_start) / 1000.0, path.c_str());
+    }).detach();
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "llama.h"
+#include "prefix-cache.h"
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Parameters used when a model is first loaded into the registry
+struct ModelConfig {
+    int n_ctx = 2048;
+    int n_batch = 512;
+    int n_ubatch = 256; // Physical batch; smaller keeps the compute buffer small on phones
+    int n_threads = 4;  // Adjust based on device
+    int n_seq_max = 4;  // Independent KV sequences sharing the context (sessions, requests)
+    size_t prefix_cache_bytes = 128u << 20; // Budget for saved prompt-prefix KV state
+    int step_token_budget = 128; // Tokens per engine step while other requests are generating
+    bool context_shift = true; // Drop old tokens instead of stopping when a sequence fills n_ctx
+    int n_keep = 4;            // Leading tokens a context shift never drops (attention sinks)
+};
+
+// A model kept resident across JNI calls together with one reusable context.
+// The context is not thread-safe: hold `mutex` for as long as `ctx` is used.
+class BatchEngine;
+class EmbeddingEngine;
+
+struct LoadedModel {
+    std::string path;
+    ModelConfig config; // the context shift settings may change later; read them with `mutex` held
+    llama_model* model = nullptr;
+    llama_context* ctx = nullptr;
+    std::mutex mutex;
+
+    // Prompt prefixes seen by earlier requests; guarded by `mutex`
+    std::unique_ptr<PrefixCache> prefixCache;
+
+    // Batches one-shot generation requests over the shared context
+    std::unique_ptr<BatchEngine> engine;
+
+    // Embedding context over the same weights, made by EmbeddingEngine::attach; guarded by `mutex`
+    std::shared_ptr<EmbeddingEngine> embedder;
+
+    // Polled by llama_decode between graph nodes; returning true aborts the
+    // decode (it returns 2). Only the ubatch it stopped in is rolled back;
+    // cells of earlier ubatches stay for the caller to remove. Set with
+    // `mutex` held, around the decode it applies to.
+    std::function<bool()> abortCheck;
+
+    // Reserves a free sequence id in `ctx`, or returns -1 if all are taken
+    llama_seq_id acquireSeq();
+
+    // Drops the sequence's KV cells and makes the id available again. Call with `mutex` held.
+    void releaseSeq(llama_seq_id seq);
+
+    ~LoadedModel();
+
+private:
+    std::mutex seqMutex_;
+    std::vector<bool> seqUsed_;
+};
+
+// Holds a sequence of `model` for one scope. The model's mutex must still be
+// held when the guard is destroyed.
+struct SeqGuard {
+    LoadedModel& model;
+    llama_seq_id id;
+
+    explicit SeqGuard(LoadedModel& m) : model(m), id(m.acquireSeq()) {}
+    ~SeqGuard() { model.releaseSeq(id); }
+
+    SeqGuard(const SeqGuard&) = delete;
+    SeqGuard& operator=(const SeqGuard&) = delete;
+};
+
+// Process-wide registry of loaded models, keyed by model path
+class ModelRegistry {
+public:
+    static ModelRegistry& instance();
+
+    // Returns the resident model for `path`, loading it on first use.
+    // Returns nullptr if the model or its context could not be created.
+    std::shared_ptr<LoadedModel> acquire(const std::string& path, const ModelConfig& config = ModelConfig());
+
+    // Drops the registry's reference; the model is freed once in-flight calls release theirs
+    bool unload(const std::string& path);
+    void unloadAll();
+
+    bool isLoaded(const std::string& path);
+
+    // Returns the resident model for `path`, or nullptr without loading it
+    std::shared_ptr<LoadedModel> find(const std::string& path);
+
+    // Loads `path` on a background thread and runs one warm-up decode so the
+    // weights are paged in before the first real request
+    void warmUpAsync(const std::string& path, const ModelConfig& config = ModelConfig());
+
+private:
+    ModelRegistry() = default;
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::shared_ptr<LoadedModel>> models_;
+};
@@ -0,0 +1,227 @@
+#include "model-store.h"
+#include "content-hash.h"
+#include "llama.h"
+#include "native-log.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char* MANIFEST_NAME = "manifest.tsv";
+
+bool statFile(const std::string& path, uint64_t& size, int64_t& mtime_ns) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    size = (uint64_t) st.st_size;
+    mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return true;
+}
+
+// Identifies a source range without reading all of it: where it sits in which
+// version of the containing file, plus XXH64 of its first and last 64 KiB so a
+// rewritten file with the same size and mtime still shows up as different
+std::string sourceIdentity(const FileRange& source) {
+    struct stat st;
+    if (fstat(source.fd, &st) != 0) {
+        return "";
+    }
+
+    const size_t edge = (size_t) std::min<int64_t>(source.length, 64 << 10);
+    std::vector<uint8_t> buffer(edge * 2);
+    const int64_t offsets[2] = {source.offset, source.offset + source.length - (int64_t) edge};
+    for (int i = 0; i < 2; i++) {
+        size_t done = 0;
+        while (done < edge) {
+            ssize_t n = pread(source.fd, buffer.data() + i * edge + done, edge - done, offsets[i] + (int64_t) done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return "";
+            }
+            done += (size_t) n;
+        }
+    }
+
+    char identity[128];
+    snprintf(identity, sizeof(identity), "%lld:%lld:%lld:%016llx", (long long) source.offset,
+             (long long) st.st_size, (long long) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec,
+             (unsigned long long) xxh64(buffer.data(), buffer.size()));
+    return identity;
+}
+
+// fsync on the directory makes a preceding rename durable
+void syncDir(const std::string& dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+} // namespace
+
+ModelStore::ModelStore(std::string rootDir) : rootDir_(std::move(rootDir)) {
+    mkdir(rootDir_.c_str(), 0700);
+    loadManifest();
+}
+
+std::string ModelStore::blobPath(const std::string& hash) const {
+    return rootDir_ + "/" + hash + ".gguf";
+}
+
+ModelStore::Entry* ModelStore::findEntry(const std::string& name) {
+    for (auto& entry : entries_) {
+        if (entry.name == name) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+bool ModelStore::loadManifest() {
+    entries_.clear();
+
+    std::ifstream in(rootDir_ + "/" + MANIFEST_NAME);
+    if (!in) {
+        return false;
+    }
+
+    // One "name<TAB>hash<TAB>size<TAB>mtime_ns<TAB>source" line per model.
+    // Older manifests lack the source; their entries are reinstalled once.
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        Entry entry;
+        if (std::getline(fields, entry.name, '\t') &&
+            std::getline(fields, entry.hash, '\t') &&
+            (fields >> entry.size >> entry.mtime_ns)) {
+            fields >> entry.source;
+            entries_.push_back(entry);
+        }
+    }
+    return true;
+}
+
+bool ModelStore::saveManifest() const {
+    const std::string path = rootDir_ + "/" + MANIFEST_NAME;
+    const std::string tmpPath = path + ".tmp";
+
+    std::string contents;
+    for (const auto& entry : entries_) {
+        contents += entry.name + "\t" + entry.hash + "\t" + std::to_string(entry.size) + "\t" +
+                    std::to_string(entry.mtime_ns) + "\t" + entry.source + "\n";
+    }
+
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGE("Failed to write manifest: %s", strerror(errno));
+        return false;
+    }
+    bool ok = write(fd, contents.data(), contents.size()) == (ssize_t) contents.size() && fsync(fd) == 0;
+    close(fd);
+
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        LOGE("Failed to replace manifest: %s", strerror(errno));
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    syncDir(rootDir_);
+    return true;
+}
+
+void ModelStore::removeUnreferencedBlob(const std::string& hash) const {
+    for (const auto& entry : entries_) {
+        if (entry.hash == hash) {
+            return;
+        }
+    }
+    unlink(blobPath(hash).c_str());
+}
+
+std::string ModelStore::install(const std::string& name, const FileRange& source,
+                                const ExtractProgressCallback& onProgress) {
+    // Fast path: the recorded blob is untouched since we verified it and
+    // was installed from this same source
+    const std::string identity = sourceIdentity(source);
+    if (Entry* entry = findEntry(name)) {
+        uint64_t size = 0;
+        int64_t mtime_ns = 0;
+        const std::string path = blobPath(entry->hash);
+        if (!identity.empty() && identity == entry->source && statFile(path, size, mtime_ns) &&
+            size == entry->size && size == (uint64_t) source.length && mtime_ns == entry->mtime_ns) {
+            return path;
+        }
+        LOGI("Stored model changed, missing or from another source, reinstalling: %s", name.c_str());
+    }
+
+    const int64_t t_start = llama_time_us();
+
+    // The source is hashed chunk by chunk while it streams through the extractor
+    const std::string tmpPath = rootDir_ + "/" + name + ".partial";
+    std::vector<uint64_t> digests;
+    ExtractOptions options;
+    options.bufferSize = HASH_CHUNK_SIZE;
+    options.chunkDigests = &digests;
+    options.onProgress = onProgress;
+    if (!extractRange(source, tmpPath, options)) {
+        LOGE("Failed to extract %s", name.c_str());
+        return "";
+    }
+
+    const std::string hash = hashFromChunkDigests(digests, (uint64_t) source.length);
+    const std::string path = blobPath(hash);
+
+    // The blob may already exist, e.g. installed under another name or with a lost manifest
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    if (statFile(path, size, mtime_ns) && size == (uint64_t) source.length && hashFile(path) == hash) {
+        unlink(tmpPath.c_str());
+    } else {
+        // Re-read what actually landed on disk before publishing it
+        if (hashFile(tmpPath) != hash) {
+            LOGE("Hash mismatch after copying %s", name.c_str());
+            unlink(tmpPath.c_str());
+            return "";
+        }
+
+        if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+            LOGE("Failed to install %s: %s", name.c_str(), strerror(errno));
+            unlink(tmpPath.c_str());
+            return "";
+        }
+        syncDir(rootDir_);
+
+        if (!statFile(path, size, mtime_ns)) {
+            return "";
+        }
+    }
+
+    std::string previousHash;
+    if (Entry* entry = findEntry(name)) {
+        previousHash = entry->hash;
+        entry->hash = hash;
+        entry->size = size;
+        entry->mtime_ns = mtime_ns;
+        entry->source = identity;
+    } else {
+        entries_.push_back({name, hash, size, mtime_ns, identity});
+    }
+    saveManifest();
+
+    if (!previousHash.empty() && previousHash != hash) {
+        removeUnreferencedBlob(previousHash);
+    }
+
+    LOGI("Installed %s as %s in %.1f ms", name.c_str(), hash.c_str(), (llama_time_us() - t_start) / 1000.0);
+    return path;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "asset-extract.h"
+#include "asset-mmap.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Content-addressed store for model files under one directory.
+//
+// Blobs are saved as <hash>.gguf and a small manifest maps each logical model
+// name to its blob together with the size and mtime seen at install time and
+// the identity of the source it was installed from.
+// Installs go through a temp file that is fsynced and renamed into place, so
+// a crash never leaves a truncated blob under its final name.
+class ModelStore {
+public:
+    struct Entry {
+        std::string name;
+        std::string hash;
+        uint64_t size = 0;
+        int64_t mtime_ns = 0;
+        std::string source; // sourceIdentity() of what was installed
+    };
+
+    explicit ModelStore(std::string rootDir);
+
+    // Returns the blob path for `name`, installing it from `source` first if the
+    // manifest has no entry, the blob no longer matches the recorded size/mtime,
+    // or `source` is not the file range it was installed from (e.g. an updated APK).
+    // Returns an empty string on failure.
+    std::string install(const std::string& name, const FileRange& source,
+                        const ExtractProgressCallback& onProgress = nullptr);
+
+    const std::string& rootDir() const { return rootDir_; }
+
+private:
+    std::string blobPath(const std::string& hash) const;
+    bool loadManifest();
+    bool saveManifest() const;
+    Entry* findEntry(const std::string& name);
+    void removeUnreferencedBlob(const std::string& hash) const;
+
+    std::string rootDir_;
+    std::vector<Entry> entries_;
+};
@@ -1,22 +1,48 @@
 #include "llama.h"
+#include "asset-mmap.h"
+#include "baked-prompts.h"
+#include "batch-engine.h"
+#include "chat-session.h"
+#include "embedding-engine.h"
+#include "model-registry.h"
+#include "model-store.h"
+#include "ngram-cache.h"
+#include "native-log.h"
+#include "request-handle.h"
+#include "token-ring.h"
+#include "token-stream.h"
+#include "vector-index.h"
 #include <jni.h>
+#include <algorithm>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <unistd.h>
 #include <vector>
-#include <android/log.h>
 #include <android/asset_manager.h>
 #include <android/asset_manager_jni.h>
 
-#define LOG_TAG "LocalLLMApp"
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+// Class and method handles resolved once in JNI_OnLoad
+struct JniCache {
+    JavaVM* vm = nullptr;
+    jclass stringClass = nullptr;
+    jmethodID stringGetBytes = nullptr;
+    jstring utf8Charset = nullptr;
+    jmethodID contextGetAssets = nullptr;
+    jmethodID contextGetFilesDir = nullptr;
+    jmethodID fileGetPath = nullptr;
+    jmethodID stringFromBytes = nullptr;
+    jmethodID onModelInstallProgress = nullptr;
+    jmethodID tokenListenerOnTokens = nullptr;
+};
+
+static JniCache g_jni;
 
 // Helper function to convert jstring to std::string
 std::string jstring2string(JNIEnv *env, jstring jStr) {
     if (!jStr) return "";
 
-    const jclass stringClass = env->GetObjectClass(jStr);
-    const jmethodID getBytes = env->GetMethodID(stringClass, "getBytes", "(Ljava/lang/String;)[B");
-    const jbyteArray stringJbytes = (jbyteArray) env->CallObjectMethod(jStr, getBytes, env->NewStringUTF("UTF-8"));
+    const jbyteArray stringJbytes = (jbyteArray) env->CallObjectMethod(jStr, g_jni.stringGetBytes, g_jni.utf8Charset);
 
     size_t length = (size_t) env->GetArrayLength(stringJbytes);
     jbyte* pBytes = env->GetByteArrayElements(stringJbytes, NULL);
@@ -25,325 +51,592 @@ std::string jstring2string(JNIEnv *env, jstring jStr) {
     env->ReleaseByteArrayElements(stringJbytes, pBytes, JNI_ABORT);
 
     env->DeleteLocalRef(stringJbytes);
-    env->DeleteLocalRef(stringClass);
+    return ret;
+}
+
+// Helper function to convert UTF-8 bytes to jstring. Unlike NewStringUTF this
+// accepts 4-byte sequences (emoji), which generated text often contains.
+jstring string2jstring(JNIEnv *env, const std::string& str) {
+    jbyteArray bytes = env->NewByteArray((jsize) str.size());
+    env->SetByteArrayRegion(bytes, 0, (jsize) str.size(), reinterpret_cast<const jbyte*>(str.data()));
+    jstring ret = (jstring) env->NewObject(g_jni.stringClass, g_jni.stringFromBytes, bytes, g_jni.utf8Charset);
+    env->DeleteLocalRef(bytes);
     return ret;
 }
 
 // Helper function to load model from assets
-std::string copyAssetToInternalStorage(JNIEnv *env, jobject context, const std::string& assetPath) {
+std::string copyAssetToInternalStorage(JNIEnv *env, jobject context, const std::string& assetPath,
+                                       const ExtractProgressCallback& onProgress = nullptr) {
     // Get AssetManager
-    jclass contextClass = env->GetObjectClass(context);
-    jmethodID getAssetsMethod = env->GetMethodID(contextClass, "getAssets", "()Landroid/content/res/AssetManager;");
-    jobject assetManager = env->CallObjectMethod(context, getAssetsMethod);
+    jobject assetManager = env->CallObjectMethod(context, g_jni.contextGetAssets);
 
     // Get internal storage path
-    jmethodID getFilesDirMethod = env->GetMethodID(contextClass, "getFilesDir", "()Ljava/io/File;");
-    jobject filesDir = env->CallObjectMethod(context, getFilesDirMethod);
-    jclass fileClass = env->GetObjectClass(filesDir);
-    jmethodID getPathMethod = env->GetMethodID(fileClass, "getPath", "()Ljava/lang/String;");
-    jstring pathJString = (jstring)env->CallObjectMethod(filesDir, getPathMethod);
+    jobject filesDir = env->CallObjectMethod(context, g_jni.contextGetFilesDir);
+    jstring pathJString = (jstring)env->CallObjectMethod(filesDir, g_jni.fileGetPath);
     std::string internalPath = jstring2string(env, pathJString);
 
     // Extract filename from asset path
     size_t lastSlash = assetPath.find_last_of('/');
     std::string filename = (lastSlash != std::string::npos) ? assetPath.substr(lastSlash + 1) : assetPath;
-    std::string destPath = internalPath + "/" + filename;
 
-    // Open asset
     AAssetManager* mgr = AAssetManager_fromJava(env, assetManager);
-    AAsset* asset = AAssetManager_open(mgr, assetPath.c_str(), AASSET_MODE_STREAMING);
-    if (!asset) {
-        LOGE("Failed to open asset: %s", assetPath.c_str());
-        return "";
-    }
 
-    // Copy to internal storage
-    FILE* out = fopen(destPath.c_str(), "wb");
-    if (!out) {
-        LOGE("Failed to open output file: %s", destPath.c_str());
-        AAsset_close(asset);
+    // Read the asset where it sits inside the APK instead of streaming it through AAsset_read
+    FileRange range;
+    if (!openAssetRange(mgr, assetPath, range)) {
+        LOGE("Failed to open asset range: %s", assetPath.c_str());
         return "";
     }
 
-    char buf[BUFSIZ];
-    int nb_read = 0;
-    while ((nb_read = AAsset_read(asset, buf, BUFSIZ)) > 0) {
-        fwrite(buf, nb_read, 1, out);
+    // The store's manifest is shared by every caller
+    static std::mutex storeMutex;
+    std::lock_guard<std::mutex> lock(storeMutex);
+
+    ModelStore store(internalPath + "/models");
+    std::string destPath = store.install(filename, range, onProgress);
+    if (destPath.empty()) {
+        LOGE("Failed to install model: %s", filename.c_str());
+        return "";
     }
 
-    fclose(out);
-    AAsset_close(asset);
+    // Earlier versions copied models to filesDir/<name> without verification
+    unlink((internalPath + "/" + filename).c_str());
 
-    LOGI("Model copied to: %s", destPath.c_str());
+    LOGI("Model available at: %s", destPath.c_str());
     return destPath;
 }
 
 // Text generation with llama (simplified version)
-std::string generateText(const std::string& prompt, const std::string& modelPath, int max_tokens = 512) {
-    LOGI("Loading model from: %s", modelPath.c_str());
+// onPiece, if set, receives each detokenized piece as soon as it is sampled
+// cancel, if set, stops the call early and frees its KV sequence
+// beam_width > 0 decodes by beam search instead of sampling; nothing is streamed then
+std::string generateText(const std::string& prompt, const std::string& modelPath, int max_tokens = 512,
+                         const std::function<void(const char*, size_t)>& onPiece = nullptr,
+                         std::shared_ptr<CancelToken> cancel = nullptr, int beam_width = 0) {
+    ModelConfig config;
+    config.n_ctx = 2048;
+    config.n_batch = 512;
+    config.n_threads = 4; // Adjust based on device
+
+    std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().acquire(modelPath, config);
+    if (!loaded) {
+        return "Error: Failed to load model";
+    }
 
-    // Initialize llama backend
-    llama_backend_init();
+    // Concurrent calls share decode steps instead of taking turns on the context
+    EngineResult result = beam_width > 0
+            ? loaded->engine->generateBeam(prompt, beam_width, max_tokens, std::move(cancel))
+            : loaded->engine->generate(prompt, max_tokens, onPiece, std::move(cancel));
+    if (!result.error.empty()) {
+        LOGE("Generation failed: %s", result.error.c_str());
+        return "Error: " + result.error;
+    }
 
-    // Load model
-    llama_model_params model_params = llama_model_default_params();
-    model_params.n_gpu_layers = 0; // CPU only for mobile
+    LOGI("Generated %d tokens", result.n_generated);
+    return prompt + result.text;
+}
 
-    llama_model* model = llama_model_load_from_file(modelPath.c_str(), model_params);
-    if (!model) {
-        LOGE("Failed to load model");
-        llama_backend_free();
-        return "Error: Failed to load model";
+// `n` completions of one prompt, without the prompt; each is "Error: ..." if it failed.
+// The prompt is prefilled once and shared by all of them.
+std::vector<std::string> generateAlternatives(const std::string& prompt, const std::string& modelPath, int n,
+                                              int max_tokens = 512, std::shared_ptr<CancelToken> cancel = nullptr) {
+    ModelConfig config;
+    config.n_ctx = 2048;
+    config.n_batch = 512;
+    config.n_threads = 4;
+
+    std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().acquire(modelPath, config);
+    if (!loaded) {
+        return std::vector<std::string>(std::max(1, n), "Error: Failed to load model");
+    }
+
+    std::vector<std::string> texts;
+    for (const EngineResult& result : loaded->engine->generateN(prompt, n, max_tokens, std::move(cancel))) {
+        if (!result.error.empty()) {
+            LOGE("Alternative failed: %s", result.error.c_str());
+            texts.push_back("Error: " + result.error);
+        } else {
+            texts.push_back(result.text);
+        }
     }
+    return texts;
+}
 
-    // Create context
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = 2048;
-    ctx_params.n_batch = 512;
-    ctx_params.n_threads = 4; // Adjust based on device
+// Multimodal generation for Gemma-based models (simplified)
+std::string generateMultimodal(const std::vector<uint8_t>& imageData, const std::string& prompt, const std::string& modelPath) {
+    LOGI("Multimodal generation with Gemma model");
 
-    llama_context* ctx = llama_init_from_model(model, ctx_params);
-    if (!ctx) {
-        LOGE("Failed to create context");
-        llama_model_free(model);
-        llama_backend_free();
-        return "Error: Failed to create context";
+    ModelConfig config;
+    config.n_ctx = 4096; // Larger context for multimodal
+    config.n_batch = 512;
+    config.n_threads = 4;
+
+    std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().acquire(modelPath, config);
+    if (!loaded) {
+        return "Error: Failed to load multimodal model";
     }
 
-    // Get vocab
-    const llama_vocab* vocab = llama_model_get_vocab(model);
+    // Format prompt for multimodal
+    std::string formatted_prompt = "User: [Image provided] " + prompt + "\nAssistant:";
 
-    // Tokenize prompt
-    std::vector<llama_token> tokens(prompt.length() + 32);
-    int n_tokens = llama_tokenize(vocab, prompt.c_str(), prompt.length(), tokens.data(), tokens.size(), true, false);
-    if (n_tokens < 0) {
-        tokens.resize(-n_tokens);
-        n_tokens = llama_tokenize(vocab, prompt.c_str(), prompt.length(), tokens.data(), tokens.size(), true, false);
+    // Runs as an engine request like text generation, so it shares decode
+    // steps instead of holding the context for the whole response; the fixed
+    // "User: [Image provided] " scaffold still comes from the prefix cache
+    EngineResult result = loaded->engine->generate(formatted_prompt, 256);
+    if (!result.error.empty()) {
+        LOGE("Failed to generate multimodal response: %s", result.error.c_str());
+        return "Error: " + result.error;
     }
-    tokens.resize(n_tokens);
+    const std::string& generated_text = result.text;
 
-    LOGI("Prompt tokenized to %d tokens", n_tokens);
+    LOGI("Generated %d tokens for multimodal response", result.n_generated);
 
-    // Use the simpler batch creation method
-    llama_batch batch = llama_batch_get_one(tokens.data(), n_tokens);
+    // Return formatted response
+    return "Image Analysis:\n" + generated_text +
+           "\n\n[Note: Full multimodal processing requires vision encoder integration. " +
+           "Image size: " + std::to_string(imageData.size()) + " bytes]";
+}
 
-    // Decode prompt
-    if (llama_decode(ctx, batch) != 0) {
-        LOGE("Failed to decode prompt");
-        llama_free(ctx);
-        llama_model_free(model);
-        llama_backend_free();
-        return "Error: Failed to decode prompt";
-    }
+using PieceCallback = std::function<void(const char*, size_t)>;
+
+// Runs `generate` with a piece callback that forwards batched deltas to a
+// TokenListener. A null listener runs it without streaming.
+jstring generateWithListener(JNIEnv *env, jobject listener,
+                             const std::function<std::string(const PieceCallback&)>& generate) {
+    // Deltas are batched so the decode loop calls into Java every few tokens, not every token
+    DeltaBatcher batcher([env, listener](const std::string& delta) {
+        jstring jDelta = string2jstring(env, delta);
+        env->CallVoidMethod(listener, g_jni.tokenListenerOnTokens, jDelta);
+        env->DeleteLocalRef(jDelta);
+        if (env->ExceptionCheck()) {
+            env->ExceptionClear();
+        }
+    });
 
-    // Generate response
-    std::string generated_text;
-    int n_cur = batch.n_tokens;
-    int n_decode = 0;
+    try {
+        PieceCallback onPiece = nullptr;
+        if (listener) {
+            onPiece = [&batcher](const char* piece, size_t n) {
+                batcher.append(piece, n);
+            };
+        }
+        std::string result = generate(onPiece);
+        if (listener) {
+            batcher.finish();
+        }
+        return string2jstring(env, result);
+    } catch (const std::exception& e) {
+        LOGE("Exception: %s", e.what());
+        return env->NewStringUTF(("Error: " + std::string(e.what())).c_str());
+    }
+}
 
-    // Setup sampling
-    llama_sampler_chain_params sparams = llama_sampler_chain_default_params();
-    llama_sampler* smpl = llama_sampler_chain_init(sparams);
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(40));
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(0.9f, 1));
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp(0.8f));
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist(1337));
+extern "C" {
 
-    // Token buffer for generation
-    llama_token new_token_id;
+JNIEXPORT jint JNICALL
+JNI_OnLoad(JavaVM* vm, void* reserved) {
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) {
+        return JNI_ERR;
+    }
 
-    while (n_decode < max_tokens) {
-        // Sample next token
-        new_token_id = llama_sampler_sample(smpl, ctx, -1);
+    g_jni.vm = vm;
 
-        // Check for EOS
-        if (llama_vocab_is_eog(vocab, new_token_id)) {
-            break;
-        }
+    jclass stringClass = env->FindClass("java/lang/String");
+    g_jni.stringClass = (jclass) env->NewGlobalRef(stringClass);
+    g_jni.stringGetBytes = env->GetMethodID(stringClass, "getBytes", "(Ljava/lang/String;)[B");
+    g_jni.stringFromBytes = env->GetMethodID(stringClass, "<init>", "([BLjava/lang/String;)V");
+    jstring utf8 = env->NewStringUTF("UTF-8");
+    g_jni.utf8Charset = (jstring) env->NewGlobalRef(utf8);
+    env->DeleteLocalRef(utf8);
+    env->DeleteLocalRef(stringClass);
 
-        // Accept token
-        llama_sampler_accept(smpl, new_token_id);
+    jclass contextClass = env->FindClass("android/content/Context");
+    g_jni.contextGetAssets = env->GetMethodID(contextClass, "getAssets", "()Landroid/content/res/AssetManager;");
+    g_jni.contextGetFilesDir = env->GetMethodID(contextClass, "getFilesDir", "()Ljava/io/File;");
+    env->DeleteLocalRef(contextClass);
 
-        // Convert token to text
-        char buf[256];
-        int n = llama_token_to_piece(vocab, new_token_id, buf, sizeof(buf), 0, false);
-        if (n > 0) {
-            generated_text.append(buf, n);
-        }
+    jclass fileClass = env->FindClass("java/io/File");
+    g_jni.fileGetPath = env->GetMethodID(fileClass, "getPath", "()Ljava/lang/String;");
+    env->DeleteLocalRef(fileClass);
 
-        // Prepare next batch with single token
-        batch = llama_batch_get_one(&new_token_id, 1);
+    jclass activityClass = env->FindClass("com/example/localllmapp/MainActivity");
+    g_jni.onModelInstallProgress = env->GetMethodID(activityClass, "onModelInstallProgress", "(JJD)V");
+    env->DeleteLocalRef(activityClass);
 
-        // Decode next token
-        if (llama_decode(ctx, batch) != 0) {
-            LOGE("Failed to decode token");
-            break;
-        }
+    jclass listenerClass = env->FindClass("com/example/localllmapp/TokenListener");
+    g_jni.tokenListenerOnTokens = env->GetMethodID(listenerClass, "onTokens", "(Ljava/lang/String;)V");
+    env->DeleteLocalRef(listenerClass);
 
-        n_cur++;
-        n_decode++;
+    if (env->ExceptionCheck()) {
+        env->ExceptionDescribe();
+        env->ExceptionClear();
+        return JNI_ERR;
     }
 
-    LOGI("Generated %d tokens", n_decode);
+    // ggml global state is set up once per process instead of per generation call
+    llama_backend_init();
+    LOGI("Native backend initialized");
 
-    // Cleanup
-    llama_sampler_free(smpl);
-    llama_free(ctx);
-    llama_model_free(model);
-    llama_backend_free();
+    return JNI_VERSION_1_6;
+}
 
-    return prompt + generated_text;
+JNIEXPORT void JNICALL
+JNI_OnUnload(JavaVM* vm, void* reserved) {
+    ModelRegistry::instance().unloadAll();
+    llama_backend_free();
 }
 
-// Multimodal generation for Gemma-based models (simplified)
-std::string generateMultimodal(const std::vector<uint8_t>& imageData, const std::string& prompt, const std::string& modelPath) {
-    LOGI("Multimodal generation with Gemma model");
+JNIEXPORT jstring JNICALL
+Java_com_example_localllmapp_MainActivity_runTextOnlyLlama(
+        JNIEnv *env,
+        jobject thiz,
+        jstring prompt,
+        jstring model_path,
+        jlong request) {
 
-    // Initialize llama backend
-    llama_backend_init();
+    std::string promptStr = jstring2string(env, prompt);
+    std::string modelPathStr = jstring2string(env, model_path);
 
-    // Load model
-    llama_model_params model_params = llama_model_default_params();
-    model_params.n_gpu_layers = 0; // CPU only for mobile
+    // If the path starts with "C:", it's likely an asset path that needs correction
+    if (modelPathStr.find("C:/") == 0 || modelPathStr.find("C:\\") == 0) {
+        // Extract just the filename
+        size_t lastSlash = modelPathStr.find_last_of("/\\");
+        std::string filename = (lastSlash != std::string::npos) ? modelPathStr.substr(lastSlash + 1) : modelPathStr;
 
-    llama_model* model = llama_model_load_from_file(modelPath.c_str(), model_params);
-    if (!model) {
-        LOGE("Failed to load multimodal model");
-        llama_backend_free();
-        return "Error: Failed to load multimodal model";
+        // Copy from assets to internal storage
+        modelPathStr = copyAssetToInternalStorage(env, thiz, filename);
+        if (modelPathStr.empty()) {
+            return env->NewStringUTF("Error: Failed to load model from assets");
+        }
     }
 
-    // Create context
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = 4096; // Larger context for multimodal
-    ctx_params.n_batch = 512;
-    ctx_params.n_threads = 4;
+    LOGI("Running text-only LLaMA with prompt: %s", promptStr.c_str());
 
-    llama_context* ctx = llama_init_from_model(model, ctx_params);
-    if (!ctx) {
-        LOGE("Failed to create context");
-        llama_model_free(model);
-        llama_backend_free();
-        return "Error: Failed to create context";
+    try {
+        std::string result = generateText(promptStr, modelPathStr, 512, nullptr,
+                                          RequestRegistry::instance().get((int64_t) request));
+        return string2jstring(env, result);
+    } catch (const std::exception& e) {
+        LOGE("Exception: %s", e.what());
+        return env->NewStringUTF(("Error: " + std::string(e.what())).c_str());
     }
+}
 
-    const llama_vocab* vocab = llama_model_get_vocab(model);
+JNIEXPORT jstring JNICALL
+Java_com_example_localllmapp_MainActivity_runTextBeamSearch(
+        JNIEnv *env,
+        jobject thiz,
+        jstring prompt,
+        jstring model_path,
+        jint beam_width,
+        jint max_tokens,
+        jlong request) {
 
-    // Format prompt for multimodal
-    std::string formatted_prompt = "User: [Image provided] " + prompt + "\nAssistant:";
+    std::string promptStr = jstring2string(env, prompt);
+    std::string modelPathStr = jstring2string(env, model_path);
+
+    std::string result = generateText(promptStr, modelPathStr, max_tokens, nullptr,
+                                      RequestRegistry::instance().get((int64_t) request), std::max(1, (int) beam_width));
+    return string2jstring(env, result);
+}
+
+JNIEXPORT jobjectArray JNICALL
+Java_com_example_localllmapp_MainActivity_runTextAlternatives(
+        JNIEnv *env,
+        jobject thiz,
+        jstring prompt,
+        jstring model_path,
+        jint n,
+        jlong request) {
+
+    std::string promptStr = jstring2string(env, prompt);
+    std::string modelPathStr = jstring2string(env, model_path);
+
+    std::vector<std::string> texts = generateAlternatives(promptStr, modelPathStr, n, 512,
+                                                          RequestRegistry::instance().get((int64_t) request));
 
-    // Tokenize prompt
-    std::vector<llama_token> tokens(formatted_prompt.length() * 2);
-    int n_tokens = llama_tokenize(vocab, formatted_prompt.c_str(), formatted_prompt.length(),
-                                  tokens.data(), tokens.size(), true, false);
-    if (n_tokens < 0) {
-        tokens.resize(-n_tokens);
-        n_tokens = llama_tokenize(vocab, formatted_prompt.c_str(), formatted_prompt.length(),
-                                  tokens.data(), tokens.size(), true, false);
+    jobjectArray result = env->NewObjectArray((jsize) texts.size(), g_jni.stringClass, nullptr);
+    for (size_t i = 0; i < texts.size(); i++) {
+        jstring text = string2jstring(env, texts[i]);
+        env->SetObjectArrayElement(result, (jsize) i, text);
+        env->DeleteLocalRef(text);
     }
-    tokens.resize(n_tokens);
+    return result;
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_localllmapp_MainActivity_runTextStreaming(
+        JNIEnv *env,
+        jobject thiz,
+        jstring prompt,
+        jstring model_path,
+        jobject listener,
+        jlong request) {
+
+    std::string promptStr = jstring2string(env, prompt);
+    std::string modelPathStr = jstring2string(env, model_path);
+    std::shared_ptr<CancelToken> cancel = RequestRegistry::instance().get((int64_t) request);
 
-    LOGI("Multimodal prompt tokenized to %d tokens", n_tokens);
+    return generateWithListener(env, listener, [&](const PieceCallback& onPiece) {
+        return generateText(promptStr, modelPathStr, 512, onPiece, cancel);
+    });
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_localllmapp_MainActivity_createRequest(
+        JNIEnv *env,
+        jobject thiz,
+        jlong timeout_ms) {
+
+    return (jlong) RequestRegistry::instance().create((int64_t) timeout_ms);
+}
 
-    // Use the simpler batch creation
-    llama_batch batch = llama_batch_get_one(tokens.data(), n_tokens);
+JNIEXPORT jboolean JNICALL
+Java_com_example_localllmapp_MainActivity_cancelRequest(
+        JNIEnv *env,
+        jobject thiz,
+        jlong request) {
+
+    return RequestRegistry::instance().cancel((int64_t) request) ? JNI_TRUE : JNI_FALSE;
+}
 
-    // Decode
-    if (llama_decode(ctx, batch) != 0) {
-        LOGE("Failed to decode multimodal prompt");
-        llama_free(ctx);
-        llama_model_free(model);
-        llama_backend_free();
-        return "Error: Failed to decode prompt";
+JNIEXPORT void JNICALL
+Java_com_example_localllmapp_MainActivity_releaseRequest(
+        JNIEnv *env,
+        jobject thiz,
+        jlong request) {
+
+    RequestRegistry::instance().release((int64_t) request);
+}
+
+JNIEXPORT jobject JNICALL
+Java_com_example_localllmapp_MainActivity_createTokenRing(
+        JNIEnv *env,
+        jobject thiz,
+        jint capacity) {
+
+    TokenRing* ring = TokenRing::create((size_t) capacity);
+    if (!ring) {
+        return nullptr;
     }
+    return env->NewDirectByteBuffer(ring->address(), (jlong) ring->totalSize());
+}
 
-    // Generate response
-    std::string generated_text;
-    int n_decode = 0;
-    int max_tokens = 256;
+JNIEXPORT void JNICALL
+Java_com_example_localllmapp_MainActivity_freeTokenRing(
+        JNIEnv *env,
+        jobject thiz,
+        jobject ring_buffer) {
 
-    // Setup sampling
-    llama_sampler_chain_params sparams = llama_sampler_chain_default_params();
-    llama_sampler* smpl = llama_sampler_chain_init(sparams);
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(40));
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(0.9f, 1));
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp(0.7f));
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist(1337));
+    TokenRing::destroy(TokenRing::fromAddress(env->GetDirectBufferAddress(ring_buffer)));
+}
 
-    llama_token new_token_id;
+JNIEXPORT jboolean JNICALL
+Java_com_example_localllmapp_MainActivity_runTextToRing(
+        JNIEnv *env,
+        jobject thiz,
+        jstring prompt,
+        jstring model_path,
+        jobject ring_buffer,
+        jlong request) {
+
+    std::string promptStr = jstring2string(env, prompt);
+    std::string modelPathStr = jstring2string(env, model_path);
+    TokenRing* ring = TokenRing::fromAddress(env->GetDirectBufferAddress(ring_buffer));
+    if (!ring) {
+        return JNI_FALSE;
+    }
 
-    while (n_decode < max_tokens) {
-        new_token_id = llama_sampler_sample(smpl, ctx, -1);
+    // A detached ring has no reader left, so it cancels the request too
+    std::shared_ptr<CancelToken> cancel = RequestRegistry::instance().get((int64_t) request);
+    if (!cancel) {
+        cancel = std::make_shared<CancelToken>();
+    }
 
-        if (llama_vocab_is_eog(vocab, new_token_id)) {
-            break;
+    // Pieces go straight into shared memory; no JNI upcalls per token
+    bool ok = true;
+    try {
+        std::string result = generateText(promptStr, modelPathStr, 512, [ring, cancel](const char* piece, size_t n) {
+            if (!ring->write(piece, n)) {
+                cancel->cancel();
+            }
+        }, cancel);
+        ok = result.rfind("Error:", 0) != 0;
+        if (!ok) {
+            ring->write(result.data(), result.size());
         }
+    } catch (const std::exception& e) {
+        LOGE("Exception: %s", e.what());
+        ok = false;
+    }
 
-        llama_sampler_accept(smpl, new_token_id);
+    ring->close(ok ? TokenRing::FINISHED : TokenRing::FAILED);
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
 
-        char buf[256];
-        int n = llama_token_to_piece(vocab, new_token_id, buf, sizeof(buf), 0, false);
-        if (n > 0) {
-            generated_text.append(buf, n);
-        }
+JNIEXPORT jlong JNICALL
+Java_com_example_localllmapp_MainActivity_createSession(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path) {
+
+    std::string modelPathStr = jstring2string(env, model_path);
+    return (jlong) SessionManager::instance().create(modelPathStr);
+}
 
-        batch = llama_batch_get_one(&new_token_id, 1);
+JNIEXPORT jlong JNICALL
+Java_com_example_localllmapp_MainActivity_createSessionWithSystemPrompt(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path,
+        jstring system_prompt) {
 
-        if (llama_decode(ctx, batch) != 0) {
-            break;
-        }
+    std::string modelPathStr = jstring2string(env, model_path);
+    std::string systemPromptStr = jstring2string(env, system_prompt);
 
-        n_decode++;
+    const int64_t handle = SessionManager::instance().create(modelPathStr);
+    std::shared_ptr<ChatSession> session = SessionManager::instance().get(handle);
+    if (!session) {
+        return 0;
     }
+    session->setSystemPrompt(systemPromptStr);
 
-    LOGI("Generated %d tokens for multimodal response", n_decode);
+    // Use the snapshot baked for this model and prompt if the APK ships one;
+    // otherwise the system prompt is prefilled with the first message
+    const std::string modelHash = modelHashFromStorePath(modelPathStr);
+    if (modelHash.empty()) {
+        return (jlong) handle;
+    }
+    const std::string assetPath = bakedPromptAssetPath(modelHash, systemPromptStr);
 
-    // Cleanup
-    llama_sampler_free(smpl);
-    llama_free(ctx);
-    llama_model_free(model);
-    llama_backend_free();
+    jobject assetManager = env->CallObjectMethod(thiz, g_jni.contextGetAssets);
+    AAssetManager* mgr = AAssetManager_fromJava(env, assetManager);
 
-    // Return formatted response
-    return "Image Analysis:\n" + generated_text +
-           "\n\n[Note: Full multimodal processing requires vision encoder integration. " +
-           "Image size: " + std::to_string(imageData.size()) + " bytes]";
+    FileRange range;
+    SessionSnapshot snapshot;
+    if (openAssetRange(mgr, assetPath, range) && readSnapshotRange(range, snapshot)) {
+        if (session->preloadPrefix(std::move(snapshot))) {
+            LOGI("Session %lld starts from baked prompt %s", (long long) handle, assetPath.c_str());
+        } else {
+            LOGE("Baked prompt %s does not match this model or prompt", assetPath.c_str());
+        }
+    }
+    return (jlong) handle;
 }
 
-extern "C" {
+JNIEXPORT jstring JNICALL
+Java_com_example_localllmapp_MainActivity_sessionSend(
+        JNIEnv *env,
+        jobject thiz,
+        jlong handle,
+        jstring message,
+        jobject listener) {
+
+    std::shared_ptr<ChatSession> session = SessionManager::instance().get((int64_t) handle);
+    if (!session) {
+        return env->NewStringUTF("Error: Unknown session");
+    }
+
+    std::string messageStr = jstring2string(env, message);
+    return generateWithListener(env, listener, [&](const PieceCallback& onPiece) {
+        return session->send(messageStr, 512, onPiece);
+    });
+}
 
 JNIEXPORT jstring JNICALL
-Java_com_example_localllmapp_MainActivity_runTextOnlyLlama(
+Java_com_example_localllmapp_MainActivity_sessionRegenerate(
         JNIEnv *env,
         jobject thiz,
-        jstring prompt,
-        jstring model_path) {
+        jlong handle,
+        jobject listener) {
+
+    std::shared_ptr<ChatSession> session = SessionManager::instance().get((int64_t) handle);
+    if (!session) {
+        return env->NewStringUTF("Error: Unknown session");
+    }
+
+    return generateWithListener(env, listener, [&](const PieceCallback& onPiece) {
+        return session->regenerate(512, onPiece);
+    });
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_localllmapp_MainActivity_sessionEdit(
+        JNIEnv *env,
+        jobject thiz,
+        jlong handle,
+        jint message_index,
+        jstring content,
+        jobject listener) {
+
+    std::shared_ptr<ChatSession> session = SessionManager::instance().get((int64_t) handle);
+    if (!session) {
+        return env->NewStringUTF("Error: Unknown session");
+    }
+
+    std::string contentStr = jstring2string(env, content);
+    return generateWithListener(env, listener, [&](const PieceCallback& onPiece) {
+        return session->editMessage((size_t) message_index, contentStr, 512, onPiece);
+    });
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_localllmapp_MainActivity_resumeSession(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path,
+        jstring snapshot_path) {
 
-    std::string promptStr = jstring2string(env, prompt);
     std::string modelPathStr = jstring2string(env, model_path);
+    std::string snapshotPathStr = jstring2string(env, snapshot_path);
+    return (jlong) SessionManager::instance().resume(modelPathStr, snapshotPathStr);
+}
 
-    // If the path starts with "C:", it's likely an asset path that needs correction
-    if (modelPathStr.find("C:/") == 0 || modelPathStr.find("C:\\") == 0) {
-        // Extract just the filename
-        size_t lastSlash = modelPathStr.find_last_of("/\\");
-        std::string filename = (lastSlash != std::string::npos) ? modelPathStr.substr(lastSlash + 1) : modelPathStr;
+JNIEXPORT void JNICALL
+Java_com_example_localllmapp_MainActivity_setSessionSnapshotPath(
+        JNIEnv *env,
+        jobject thiz,
+        jlong handle,
+        jstring snapshot_path) {
 
-        // Copy from assets to internal storage
-        modelPathStr = copyAssetToInternalStorage(env, thiz, filename);
-        if (modelPathStr.empty()) {
-            return env->NewStringUTF("Error: Failed to load model from assets");
-        }
+    std::shared_ptr<ChatSession> session = SessionManager::instance().get((int64_t) handle);
+    if (session) {
+        session->setSnapshotPath(jstring2string(env, snapshot_path));
     }
+}
 
-    LOGI("Running text-only LLaMA with prompt: %s", promptStr.c_str());
+JNIEXPORT jobjectArray JNICALL
+Java_com_example_localllmapp_MainActivity_sessionHistory(
+        JNIEnv *env,
+        jobject thiz,
+        jlong handle) {
 
-    try {
-        std::string result = generateText(promptStr, modelPathStr);
-        return env->NewStringUTF(result.c_str());
-    } catch (const std::exception& e) {
-        LOGE("Exception: %s", e.what());
-        return env->NewStringUTF(("Error: " + std::string(e.what())).c_str());
+    std::vector<ChatMessage> history;
+    if (std::shared_ptr<ChatSession> session = SessionManager::instance().get((int64_t) handle)) {
+        history = session->history();
     }
+
+    // Flattened as role, content, role, content, ...
+    jobjectArray result = env->NewObjectArray((jsize) (history.size() * 2), g_jni.stringClass, nullptr);
+    for (size_t i = 0; i < history.size(); i++) {
+        jstring role = string2jstring(env, history[i].role);
+        jstring content = string2jstring(env, history[i].content);
+        env->SetObjectArrayElement(result, (jsize) (i * 2), role);
+        env->SetObjectArrayElement(result, (jsize) (i * 2 + 1), content);
+        env->DeleteLocalRef(role);
+        env->DeleteLocalRef(content);
+    }
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_localllmapp_MainActivity_closeSession(
+        JNIEnv *env,
+        jobject thiz,
+        jlong handle) {
+
+    SessionManager::instance().close((int64_t) handle);
 }
 
 JNIEXPORT jstring JNICALL
@@ -366,11 +659,387 @@ Java_com_example_localllmapp_MainActivity_runMultimodalLlama(
 
     try {
         std::string result = generateMultimodal(imageVec, promptStr, modelPathStr);
-        return env->NewStringUTF(result.c_str());
+        return string2jstring(env, result);
     } catch (const std::exception& e) {
         LOGE("Exception: %s", e.what());
         return env->NewStringUTF(("Error: " + std::string(e.what())).c_str());
     }
 }
 
+JNIEXPORT jstring JNICALL
+Java_com_example_localllmapp_MainActivity_prepareModel(
+        JNIEnv *env,
+        jobject thiz,
+        jstring asset_name) {
+
+    std::string assetNameStr = jstring2string(env, asset_name);
+
+    // Progress is reported from the extractor's writer loop, which runs on this thread
+    auto onProgress = [env, thiz](const ExtractProgress& progress) {
+        env->CallVoidMethod(thiz, g_jni.onModelInstallProgress,
+                            (jlong) progress.done, (jlong) progress.total, (jdouble) progress.mb_per_s);
+        if (env->ExceptionCheck()) {
+            env->ExceptionClear();
+        }
+    };
+
+    std::string path = copyAssetToInternalStorage(env, thiz, assetNameStr, onProgress);
+    return env->NewStringUTF(path.c_str());
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_localllmapp_MainActivity_loadModel(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path,
+        jboolean embedding_only) {
+
+    std::string modelPathStr = jstring2string(env, model_path);
+
+    // A model that only embeds never generates, so its generation context stays small
+    ModelConfig config;
+    if (embedding_only == JNI_TRUE) {
+        config.n_ctx = 512;
+        config.n_seq_max = 1;
+    }
+    return ModelRegistry::instance().acquire(modelPathStr, config) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_localllmapp_MainActivity_warmUpModel(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path) {
+
+    std::string modelPathStr = jstring2string(env, model_path);
+    ModelRegistry::instance().warmUpAsync(modelPathStr);
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_localllmapp_MainActivity_prefixCacheStats(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path) {
+
+    std::string modelPathStr = jstring2string(env, model_path);
+
+    jlong values[7] = {};
+    if (std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().find(modelPathStr)) {
+        std::lock_guard<std::mutex> lock(loaded->mutex);
+        const PrefixCache::Stats& stats = loaded->prefixCache->stats();
+        values[0] = (jlong) stats.hits;
+        values[1] = (jlong) stats.misses;
+        values[2] = (jlong) stats.reusedTokens;
+        values[3] = (jlong) stats.inserts;
+        values[4] = (jlong) stats.evictions;
+        values[5] = (jlong) stats.bytes;
+        values[6] = (jlong) stats.entries;
+    }
+
+    jlongArray result = env->NewLongArray(7);
+    env->SetLongArrayRegion(result, 0, 7, values);
+    return result;
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_localllmapp_MainActivity_engineStats(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path) {
+
+    std::string modelPathStr = jstring2string(env, model_path);
+
+    jlong values[7] = {};
+    if (std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().find(modelPathStr)) {
+        BatchEngine::Stats stats = loaded->engine->stats();
+        values[0] = (jlong) stats.steps;
+        values[1] = (jlong) stats.requests;
+        values[2] = (jlong) stats.promptTokens;
+        values[3] = (jlong) stats.generatedTokens;
+        values[4] = (jlong) stats.decodeUs;
+        values[5] = (jlong) stats.maxDecodeStepUs;
+        values[6] = (jlong) stats.contextShifts;
+    }
+
+    jlongArray result = env->NewLongArray(7);
+    env->SetLongArrayRegion(result, 0, 7, values);
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_localllmapp_MainActivity_setContextShift(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path,
+        jboolean enabled,
+        jint keep_tokens) {
+
+    std::string modelPathStr = jstring2string(env, model_path);
+    if (std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().find(modelPathStr)) {
+        std::lock_guard<std::mutex> lock(loaded->mutex);
+        loaded->config.context_shift = enabled == JNI_TRUE;
+        loaded->config.n_keep = std::max(0, (int) keep_tokens);
+    }
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_localllmapp_MainActivity_setEngineStepBudget(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path,
+        jint tokens) {
+
+    std::string modelPathStr = jstring2string(env, model_path);
+    if (std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().find(modelPathStr)) {
+        loaded->engine->setStepBudget(tokens);
+    }
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_localllmapp_MainActivity_setDraftModel(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path,
+        jstring draft_model_path) {
+
+    std::string modelPathStr = jstring2string(env, model_path);
+    std::string draftPathStr = jstring2string(env, draft_model_path);
+
+    // Both models must already be loaded; changing an option never loads one
+    std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().find(modelPathStr);
+    if (!loaded) {
+        return JNI_FALSE;
+    }
+
+    // An empty path turns the draft model off
+    SpeculativeConfig config = loaded->engine->speculation();
+    config.draftModel = nullptr;
+    if (!draftPathStr.empty()) {
+        config.draftModel = ModelRegistry::instance().find(draftPathStr);
+        if (!config.draftModel) {
+            return JNI_FALSE;
+        }
+    }
+    return loaded->engine->setSpeculation(config) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_localllmapp_MainActivity_setPromptLookup(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path,
+        jboolean enabled) {
+
+    std::string modelPathStr = jstring2string(env, model_path);
+    if (std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().find(modelPathStr)) {
+        SpeculativeConfig config = loaded->engine->speculation();
+        config.promptLookup = enabled == JNI_TRUE;
+        loaded->engine->setSpeculation(config);
+    }
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_localllmapp_MainActivity_setDraftBranches(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path,
+        jint branches) {
+
+    std::string modelPathStr = jstring2string(env, model_path);
+    if (std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().find(modelPathStr)) {
+        SpeculativeConfig config = loaded->engine->speculation();
+        config.maxBranches = branches;
+        loaded->engine->setSpeculation(config);
+    }
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_localllmapp_MainActivity_setNgramCache(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path,
+        jstring cache_path) {
+
+    std::string modelPathStr = jstring2string(env, model_path);
+    std::string cachePathStr = jstring2string(env, cache_path);
+
+    std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().find(modelPathStr);
+    if (!loaded) {
+        return JNI_FALSE;
+    }
+
+    // An empty path turns the cache off
+    SpeculativeConfig config = loaded->engine->speculation();
+    config.ngramCache = nullptr;
+    if (!cachePathStr.empty()) {
+        config.ngramCache = std::make_shared<NgramCache>();
+        if (!config.ngramCache->open(cachePathStr)) {
+            return JNI_FALSE;
+        }
+    }
+    return loaded->engine->setSpeculation(config) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_com_example_localllmapp_MainActivity_speculationStats(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path) {
+
+    std::string modelPathStr = jstring2string(env, model_path);
+
+    const int n_values = 3 * DRAFT_KIND_COUNT;
+    jlong values[n_values] = {};
+    if (std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().find(modelPathStr)) {
+        BatchEngine::Stats stats = loaded->engine->stats();
+        for (int kind = 0; kind < DRAFT_KIND_COUNT; kind++) {
+            values[3 * kind + 0] = (jlong) stats.speculation[kind].steps;
+            values[3 * kind + 1] = (jlong) stats.speculation[kind].drafted;
+            values[3 * kind + 2] = (jlong) stats.speculation[kind].accepted;
+        }
+    }
+
+    jlongArray result = env->NewLongArray(n_values);
+    env->SetLongArrayRegion(result, 0, n_values, values);
+    return result;
+}
+
+JNIEXPORT jfloatArray JNICALL
+Java_com_example_localllmapp_MainActivity_embedTexts(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path,
+        jobjectArray texts,
+        jint pooling) {
+
+    std::string modelPathStr = jstring2string(env, model_path);
+
+    std::vector<std::string> textsStr;
+    const jsize n_texts = env->GetArrayLength(texts);
+    textsStr.reserve(n_texts);
+    for (jsize i = 0; i < n_texts; i++) {
+        jstring text = (jstring) env->GetObjectArrayElement(texts, i);
+        textsStr.push_back(text ? jstring2string(env, text) : std::string());
+        env->DeleteLocalRef(text);
+    }
+
+    // Embeddings run in the engine's own context, so the model keeps the
+    // default generation context even when this call loads it; load
+    // embedding-only models with loadModel(path, true) to keep that small
+    std::vector<float> embeddings;
+    std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().acquire(modelPathStr);
+    if (loaded) {
+        EmbeddingConfig embeddingConfig;
+        embeddingConfig.pooling = (enum llama_pooling_type) pooling;
+        std::shared_ptr<EmbeddingEngine> embedder = EmbeddingEngine::attach(*loaded, embeddingConfig);
+        if (!embedder || !embedder->embed(textsStr, embeddings)) {
+            embeddings.clear();
+        }
+    }
+
+    // Row-major, one row of the model's dimension per text; empty on failure
+    jfloatArray result = env->NewFloatArray((jsize) embeddings.size());
+    env->SetFloatArrayRegion(result, 0, (jsize) embeddings.size(), embeddings.data());
+    return result;
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_localllmapp_MainActivity_openVectorIndex(
+        JNIEnv *env,
+        jobject thiz,
+        jstring path,
+        jint dimension,
+        jboolean quantized) {
+
+    std::string pathStr = jstring2string(env, path);
+    return (jlong) VectorIndexManager::instance().open(pathStr, dimension,
+                                                       quantized == JNI_TRUE ? GGML_TYPE_Q8_0 : GGML_TYPE_F16);
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_example_localllmapp_MainActivity_vectorIndexAdd(
+        JNIEnv *env,
+        jobject thiz,
+        jlong handle,
+        jfloatArray vectors) {
+
+    std::shared_ptr<VectorIndex> index = VectorIndexManager::instance().get((int64_t) handle);
+    const jsize length = env->GetArrayLength(vectors);
+    if (!index || length % index->dimension() != 0) {
+        return -1;
+    }
+
+    jfloat* data = env->GetFloatArrayElements(vectors, nullptr);
+    const int64_t first = index->add(data, (size_t) (length / index->dimension()));
+    env->ReleaseFloatArrayElements(vectors, data, JNI_ABORT);
+    return (jlong) first;
+}
+
+JNIEXPORT jintArray JNICALL
+Java_com_example_localllmapp_MainActivity_vectorIndexSearch(
+        JNIEnv *env,
+        jobject thiz,
+        jlong handle,
+        jfloatArray query,
+        jint k,
+        jfloatArray scores) {
+
+    std::vector<VectorIndex::Hit> hits;
+    std::shared_ptr<VectorIndex> index = VectorIndexManager::instance().get((int64_t) handle);
+    if (index && env->GetArrayLength(query) == index->dimension()) {
+        jfloat* data = env->GetFloatArrayElements(query, nullptr);
+        hits = index->search(data, k);
+        env->ReleaseFloatArrayElements(query, data, JNI_ABORT);
+    }
+
+    std::vector<jint> rows;
+    std::vector<jfloat> values;
+    for (const VectorIndex::Hit& hit : hits) {
+        rows.push_back((jint) hit.row);
+        values.push_back(hit.score);
+    }
+    if (scores && env->GetArrayLength(scores) >= (jsize) values.size()) {
+        env->SetFloatArrayRegion(scores, 0, (jsize) values.size(), values.data());
+    }
+
+    jintArray result = env->NewIntArray((jsize) rows.size());
+    env->SetIntArrayRegion(result, 0, (jsize) rows.size(), rows.data());
+    return result;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_localllmapp_MainActivity_setVectorIndexGraph(
+        JNIEnv *env,
+        jobject thiz,
+        jlong handle,
+        jboolean enabled) {
+
+    if (std::shared_ptr<VectorIndex> index = VectorIndexManager::instance().get((int64_t) handle)) {
+        index->setGraph(enabled == JNI_TRUE);
+    }
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_localllmapp_MainActivity_closeVectorIndex(
+        JNIEnv *env,
+        jobject thiz,
+        jlong handle) {
+
+    VectorIndexManager::instance().close((int64_t) handle);
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_localllmapp_MainActivity_unloadModel(
+        JNIEnv *env,
+        jobject thiz,
+        jstring model_path) {
+
+    std::string modelPathStr = jstring2string(env, model_path);
+    if (modelPathStr.empty()) {
+        ModelRegistry::instance().unloadAll();
+    } else {
+        ModelRegistry::instance().unload(modelPathStr);
+    }
+}
+
 } // extern "C"
\ No newline at end of file
@@ -0,0 +1,16 @@
+#pragma once
+
+#define LOG_TAG "LocalLLMApp"
+
+#ifdef __ANDROID__
+#include <android/log.h>
+
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#else
+// Host builds (tools, desktop testing) log to stderr
+#include <cstdio>
+
+#define LOGI(...) (fprintf(stderr, "I/" LOG_TAG ": " __VA_ARGS__), fputc('\n', stderr))
+#define LOGE(...) (fprintf(stderr, "E/" LOG_TAG ": " __VA_ARGS__), fputc('\n', stderr))
+#endif
@@ -0,0 +1,210 @@
+#include "ngram-cache.h"
+#include "native-log.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+const uint32_t NGRAM_CACHE_MAGIC = 0x4e4d4c4c; // "LLMN"
+const uint32_t NGRAM_CACHE_VERSION = 1;
+
+// Slots per set; a set fills one 64-byte cache line
+const uint32_t WAYS = 4;
+
+uint64_t hashContext(const llama_token* context, int n) {
+    uint64_t h = 0xcbf29ce484222325ull ^ (uint64_t) n;
+    for (int i = 0; i < n; i++) {
+        h = (h ^ (uint32_t) context[i]) * 0x100000001b3ull;
+    }
+    return h != 0 ? h : 1; // 0 marks an empty slot
+}
+
+} // namespace
+
+struct NgramCache::Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_sets;
+    uint32_t ways;
+    uint64_t updates; // since the last decay
+    uint64_t decays;
+    uint8_t reserved[32];
+};
+
+struct NgramCache::Slot {
+    uint64_t key;
+    llama_token next;
+    uint16_t count;
+    uint16_t reserved;
+};
+
+NgramCache::~NgramCache() {
+    close();
+}
+
+bool NgramCache::open(const std::string& path, size_t n_slots) {
+    static_assert(sizeof(Header) == 64, "header must stay 64 bytes");
+    static_assert(sizeof(Slot) * WAYS == 64, "a set must fill one cache line");
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (map_) {
+        munmap(map_, mapSize_);
+        map_ = nullptr;
+    }
+
+    const uint32_t n_sets = (uint32_t) std::max<size_t>(1, n_slots / WAYS);
+    const size_t size = sizeof(Header) + (size_t) n_sets * WAYS * sizeof(Slot);
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGE("Failed to open n-gram cache: %s", path.c_str());
+        return false;
+    }
+
+    // A table of another size is rebuilt below once its header fails to match
+    if (ftruncate(fd, (off_t) size) != 0) {
+        LOGE("Failed to size n-gram cache: %s", path.c_str());
+        ::close(fd);
+        return false;
+    }
+
+    void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        LOGE("Failed to map n-gram cache: %s", path.c_str());
+        return false;
+    }
+
+    map_ = map;
+    mapSize_ = size;
+    path_ = path;
+    header_ = (Header*) map;
+    slots_ = (Slot*) ((uint8_t*) map + sizeof(Header));
+
+    if (header_->magic != NGRAM_CACHE_MAGIC || header_->version != NGRAM_CACHE_VERSION ||
+        header_->n_sets != n_sets || header_->ways != WAYS) {
+        memset(map_, 0, mapSize_);
+        header_->magic = NGRAM_CACHE_MAGIC;
+        header_->version = NGRAM_CACHE_VERSION;
+        header_->n_sets = n_sets;
+        header_->ways = WAYS;
+        LOGI("Created n-gram cache with %u slots: %s", n_sets * WAYS, path.c_str());
+    }
+    return true;
+}
+
+void NgramCache::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (map_) {
+        msync(map_, mapSize_, MS_ASYNC);
+        munmap(map_, mapSize_);
+    }
+    map_ = nullptr;
+    mapSize_ = 0;
+    header_ = nullptr;
+    slots_ = nullptr;
+}
+
+const NgramCache::Slot* NgramCache::find(const llama_token* context, int n) const {
+    const uint64_t key = hashContext(context, n);
+    const Slot* set = slots_ + (key % header_->n_sets) * WAYS;
+    for (uint32_t i = 0; i < WAYS; i++) {
+        if (set[i].key == key && set[i].count > 0) {
+            return &set[i];
+        }
+    }
+    return nullptr;
+}
+
+void NgramCache::add(const llama_token* context, int n, llama_token next) {
+    const uint64_t key = hashContext(context, n);
+    Slot* set = slots_ + (key % header_->n_sets) * WAYS;
+
+    Slot* victim = &set[0];
+    for (uint32_t i = 0; i < WAYS; i++) {
+        Slot& slot = set[i];
+        if (slot.key == key) {
+            if (slot.next == next) {
+                slot.count = (uint16_t) std::min<int>(slot.count + 1, UINT16_MAX);
+            } else if (slot.count > 1) {
+                slot.count--;
+            } else {
+                slot.next = next;
+                slot.count = 1;
+            }
+            return;
+        }
+        if (slot.count < victim->count) {
+            victim = &slot;
+        }
+    }
+
+    // New context: take an empty slot or the weakest one in the set
+    victim->key = key;
+    victim->next = next;
+    victim->count = 1;
+}
+
+void NgramCache::decay() {
+    const size_t n_slots = (size_t) header_->n_sets * WAYS;
+    for (size_t i = 0; i < n_slots; i++) {
+        slots_[i].count >>= 1;
+        if (slots_[i].count == 0) {
+            slots_[i].key = 0;
+        }
+    }
+    header_->updates = 0;
+    header_->decays++;
+}
+
+void NgramCache::update(const llama_token* tokens, size_t n) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!header_) {
+        return;
+    }
+
+    const uint64_t n_slots = (uint64_t) header_->n_sets * WAYS;
+    for (size_t i = CONTEXT_MIN; i < n; i++) {
+        for (int c = CONTEXT_MIN; c <= CONTEXT_MAX && (size_t) c <= i; c++) {
+            add(tokens + i - c, c, tokens[i]);
+        }
+        if (++header_->updates >= n_slots) {
+            decay();
+        }
+    }
+}
+
+size_t NgramCache::draft(const std::vector<llama_token>& history, int n_max, std::vector<llama_token>& out,
+                         uint16_t minCount) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!header_ || history.size() < (size_t) CONTEXT_MIN) {
+        return 0;
+    }
+
+    // The context slides over the tokens drafted so far
+    std::vector<llama_token> context(history.end() - std::min<size_t>(history.size(), CONTEXT_MAX), history.end());
+    size_t n_drafted = 0;
+    while ((int) n_drafted < n_max) {
+        const Slot* best = nullptr;
+        for (int c = std::min<int>(CONTEXT_MAX, (int) context.size()); c >= CONTEXT_MIN && !best; c--) {
+            const Slot* slot = find(context.data() + context.size() - c, c);
+            if (slot && slot->count >= minCount) {
+                best = slot;
+            }
+        }
+        if (!best) {
+            break;
+        }
+
+        out.push_back(best->next);
+        n_drafted++;
+        context.push_back(best->next);
+        if (context.size() > (size_t) CONTEXT_MAX) {
+            context.erase(context.begin());
+        }
+    }
+    return n_drafted;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "llama.h"
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Persistent table of which token tends to follow a short context, learned
+// from earlier generations. It is a fixed-size, set-associative file mapped
+// into memory, so its size is bounded, lookups touch a single cache line and
+// the kernel writes it back without explicit saves.
+//
+// Each slot keeps one continuation per context with a majority-vote count:
+// seeing the same token again raises the count, a different token lowers it
+// and takes the slot over at zero. All counts are halved every `n_slots`
+// updates, so old habits fade and evicted slots free up.
+class NgramCache {
+public:
+    static constexpr int CONTEXT_MIN = 2;
+    static constexpr int CONTEXT_MAX = 3;
+
+    NgramCache() = default;
+    NgramCache(const NgramCache&) = delete;
+    NgramCache& operator=(const NgramCache&) = delete;
+    ~NgramCache();
+
+    // Maps `path`, creating or resetting it if it does not hold a table of
+    // `n_slots` slots. Token ids are model specific: use one file per model.
+    bool open(const std::string& path, size_t n_slots = 1u << 16);
+    void close();
+    bool valid() const { return header_ != nullptr; }
+
+    // Learns from a finished generation; `tokens` should start with a few
+    // context tokens before the generated ones
+    void update(const llama_token* tokens, size_t n);
+
+    // Follows the most likely continuation of `history` for up to `n_max`
+    // tokens, stopping at contexts seen fewer than `minCount` times
+    size_t draft(const std::vector<llama_token>& history, int n_max, std::vector<llama_token>& out,
+                 uint16_t minCount = 2);
+
+private:
+    struct Header;
+    struct Slot;
+
+    const Slot* find(const llama_token* context, int n) const;
+    void add(const llama_token* context, int n, llama_token next);
+    void decay();
+
+    std::mutex mutex_;
+    std::string path_;
+    void* map_ = nullptr;
+    size_t mapSize_ = 0;
+    Header* header_ = nullptr;
+    Slot* slots_ = nullptr;
+};
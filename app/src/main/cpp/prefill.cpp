@@ -0,0 +1,111 @@
+#include "prefill.h"
+#include "native-log.h"
+#include <algorithm>
+
+std::vector<llama_token> tokenizeText(const llama_vocab* vocab, const std::string& text,
+                                      bool add_special, bool parse_special) {
+    std::vector<llama_token> tokens(text.length() + 32);
+    int n_tokens = llama_tokenize(vocab, text.c_str(), text.length(), tokens.data(), tokens.size(),
+                                  add_special, parse_special);
+    if (n_tokens < 0) {
+        tokens.resize(-n_tokens);
+        n_tokens = llama_tokenize(vocab, text.c_str(), text.length(), tokens.data(), tokens.size(),
+                                  add_special, parse_special);
+    }
+    tokens.resize(std::max(0, n_tokens));
+    return tokens;
+}
+
+PrefillStatus prefillTokens(llama_context* ctx, const llama_token* tokens, int n_tokens, llama_pos pos0,
+                            const PrefillOptions& options) {
+    if (n_tokens <= 0) {
+        return PREFILL_OK;
+    }
+
+    if (pos0 + n_tokens > (int) llama_n_ctx(ctx)) {
+        LOGE("Prompt of %d tokens at position %d does not fit in n_ctx = %u", n_tokens, pos0, llama_n_ctx(ctx));
+        return PREFILL_CONTEXT_FULL;
+    }
+
+    int n_batch = (int) llama_n_batch(ctx);
+    if (options.max_chunk > 0) {
+        n_batch = std::min(n_batch, options.max_chunk);
+    }
+
+    // Same number of chunks as fixed n_batch splitting, but evenly sized
+    const int n_chunks = (n_tokens + n_batch - 1) / n_batch;
+    const int chunk_size = (n_tokens + n_chunks - 1) / n_chunks;
+
+    llama_batch batch = llama_batch_init(chunk_size, 0, 1);
+    PrefillStatus status = PREFILL_OK;
+
+    PrefillChunkStats stats;
+    stats.n_total = n_tokens;
+
+    for (int start = 0; start < n_tokens; start += chunk_size) {
+        if (start > 0 && options.betweenChunks) {
+            options.betweenChunks();
+        }
+        if (options.shouldContinue && !options.shouldContinue()) {
+            status = PREFILL_CANCELLED;
+            break;
+        }
+
+        const int n = std::min(chunk_size, n_tokens - start);
+        batch.n_tokens = n;
+        for (int i = 0; i < n; i++) {
+            batch.token[i] = tokens[start + i];
+            batch.pos[i] = pos0 + start + i;
+            batch.n_seq_id[i] = 1;
+            batch.seq_id[i][0] = options.seq_id;
+            batch.logits[i] = false;
+        }
+        if (options.logits_last && start + n == n_tokens) {
+            batch.logits[n - 1] = true;
+        }
+
+        const int64_t t_start = llama_time_us();
+        const int ret = llama_decode(ctx, batch);
+        if (ret != 0) {
+            LOGE("Prefill chunk %d failed with %d", stats.index, ret);
+            status = ret == 2 ? PREFILL_CANCELLED : PREFILL_FAILED;
+            break;
+        }
+
+        stats.n_tokens = n;
+        stats.n_done = start + n;
+        stats.t_us = llama_time_us() - t_start;
+        if (options.onChunk) {
+            options.onChunk(stats);
+        }
+        stats.index++;
+    }
+
+    llama_batch_free(batch);
+    return status;
+}
+
+int32_t decodeToken(llama_context* ctx, llama_token token, llama_pos pos, llama_seq_id seq_id) {
+    int32_t n_seq_id = 1;
+    llama_seq_id* seq_ids = &seq_id;
+    int8_t logits = 1;
+
+    llama_batch batch = {};
+    batch.n_tokens = 1;
+    batch.token = &token;
+    batch.pos = &pos;
+    batch.n_seq_id = &n_seq_id;
+    batch.seq_id = &seq_ids;
+    batch.logits = &logits;
+    return llama_decode(ctx, batch);
+}
+
+const char* prefillStatusMessage(PrefillStatus status) {
+    switch (status) {
+        case PREFILL_OK:           return "ok";
+        case PREFILL_CANCELLED:    return "cancelled";
+        case PREFILL_CONTEXT_FULL: return "prompt does not fit in the context";
+        case PREFILL_FAILED:       return "failed to decode prompt";
+    }
+    return "unknown";
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "llama.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Tokenizes `text`, growing the buffer when llama_tokenize asks for more room
+std::vector<llama_token> tokenizeText(const llama_vocab* vocab, const std::string& text,
+                                      bool add_special, bool parse_special = false);
+
+struct PrefillChunkStats {
+    int index = 0;        // chunk number, from 0
+    int n_tokens = 0;     // tokens in this chunk
+    int n_done = 0;       // tokens prefilled so far, including this chunk
+    int n_total = 0;
+    int64_t t_us = 0;     // wall time of this chunk's llama_decode
+};
+
+struct PrefillOptions {
+    llama_seq_id seq_id = 0;
+
+    // Request logits for the final prompt token so sampling can start right away
+    bool logits_last = true;
+
+    // Called after every chunk
+    std::function<void(const PrefillChunkStats&)> onChunk;
+
+    // Checked before every chunk; returning false stops the prefill
+    std::function<bool()> shouldContinue;
+
+    // Upper bound on chunk size below n_batch, e.g. a batching engine's step
+    // budget; 0 leaves chunks at n_batch
+    int max_chunk = 0;
+
+    // Called between two chunks, e.g. to let other users of the context decode
+    std::function<void()> betweenChunks;
+};
+
+enum PrefillStatus {
+    PREFILL_OK = 0,
+    PREFILL_CANCELLED = 1,
+    PREFILL_CONTEXT_FULL = 2,
+    PREFILL_FAILED = 3,
+};
+
+// Decodes `tokens` at positions [pos0, pos0 + n) of `seq_id` in chunks of at
+// most n_batch (or options.max_chunk) tokens. Chunk sizes are balanced so a prompt slightly longer
+// than n_batch does not end in a nearly empty chunk.
+PrefillStatus prefillTokens(llama_context* ctx, const llama_token* tokens, int n_tokens, llama_pos pos0,
+                            const PrefillOptions& options = PrefillOptions());
+
+const char* prefillStatusMessage(PrefillStatus status);
+
+// Decodes a single token at `pos` of `seq_id` with logits enabled, without
+// allocating a batch. Returns the llama_decode result.
+int32_t decodeToken(llama_context* ctx, llama_token token, llama_pos pos, llama_seq_id seq_id);
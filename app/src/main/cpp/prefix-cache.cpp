@@ -0,0 +1,190 @@
+#include "prefix-cache.h"
+#include "native-log.h"
+#include <algorithm>
+
+PrefixCache::PrefixCache(size_t byteBudget, size_t minTokens)
+        : root_(new Node()), byteBudget_(byteBudget), minTokens_(minTokens) {
+}
+
+PrefixCache::Node* PrefixCache::newestEntry(Node* node) {
+    Node* best = node->state.empty() ? nullptr : node;
+    for (auto& child : node->children) {
+        Node* candidate = newestEntry(child.second.get());
+        if (candidate && (!best || candidate->lastUsed > best->lastUsed)) {
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+PrefixCache::Node* PrefixCache::oldestEntry(Node* node, Node* best) {
+    if (!node->state.empty() && (!best || node->lastUsed < best->lastUsed)) {
+        best = node;
+    }
+    for (auto& child : node->children) {
+        best = oldestEntry(child.second.get(), best);
+    }
+    return best;
+}
+
+bool PrefixCache::pruneEmpty(Node* node) {
+    for (auto it = node->children.begin(); it != node->children.end();) {
+        if (pruneEmpty(it->second.get())) {
+            it = node->children.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return node->children.empty() && node->state.empty();
+}
+
+size_t PrefixCache::restore(llama_context* ctx, const std::vector<llama_token>& tokens, llama_seq_id seq) {
+    // Walk down as far as the prompt matches, remembering the deepest full entry on the path
+    Node* node = root_.get();
+    Node* deepest = nullptr;
+    size_t matched = 0;
+    Node* partial = nullptr; // subtree that shares `matched` tokens but ends past them
+
+    while (matched < tokens.size()) {
+        auto it = node->children.find(tokens[matched]);
+        if (it == node->children.end()) {
+            break;
+        }
+        Node* child = it->second.get();
+
+        size_t i = 0;
+        while (i < child->edge.size() && matched + i < tokens.size() && child->edge[i] == tokens[matched + i]) {
+            i++;
+        }
+        matched += i;
+        if (i < child->edge.size()) {
+            partial = child;
+            break;
+        }
+        node = child;
+        if (!node->state.empty()) {
+            deepest = node;
+        }
+    }
+
+    // An entry ending past the divergence point also holds the shared tokens;
+    // restore it and cut the sequence back to the common part
+    Node* source = deepest;
+    size_t usable = deepest ? deepest->depth : 0;
+    Node* below = partial ? newestEntry(partial) : (matched == tokens.size() ? newestEntry(node) : nullptr);
+    if (below && matched > usable) {
+        source = below;
+        usable = matched;
+    }
+
+    // The caller needs logits for the last prompt token, so it must decode at least that one
+    usable = std::min(usable, tokens.size() > 0 ? tokens.size() - 1 : 0);
+
+    if (!source || usable < minTokens_) {
+        stats_.misses++;
+        return 0;
+    }
+
+    llama_memory_t mem = llama_get_memory(ctx);
+    if (llama_state_seq_set_data(ctx, source->state.data(), source->state.size(), seq) == 0) {
+        LOGE("Prefix cache entry failed to restore");
+        llama_memory_seq_rm(mem, seq, -1, -1);
+        stats_.misses++;
+        return 0;
+    }
+    if (source->depth > usable && !llama_memory_seq_rm(mem, seq, (llama_pos) usable, -1)) {
+        llama_memory_seq_rm(mem, seq, -1, -1);
+        stats_.misses++;
+        return 0;
+    }
+
+    source->lastUsed = ++tick_;
+    stats_.hits++;
+    stats_.reusedTokens += usable;
+    return usable;
+}
+
+void PrefixCache::insert(llama_context* ctx, const llama_token* tokens, size_t n, llama_seq_id seq) {
+    if (n < minTokens_) {
+        return;
+    }
+
+    // Descend, splitting an edge where the new prefix leaves it
+    Node* node = root_.get();
+    size_t pos = 0;
+    while (pos < n) {
+        auto it = node->children.find(tokens[pos]);
+        if (it == node->children.end()) {
+            std::unique_ptr<Node> leaf(new Node());
+            leaf->edge.assign(tokens + pos, tokens + n);
+            leaf->depth = n;
+            Node* raw = leaf.get();
+            node->children[tokens[pos]] = std::move(leaf);
+            node = raw;
+            pos = n;
+            break;
+        }
+
+        Node* child = it->second.get();
+        size_t i = 0;
+        while (i < child->edge.size() && pos + i < n && child->edge[i] == tokens[pos + i]) {
+            i++;
+        }
+
+        if (i < child->edge.size()) {
+            std::unique_ptr<Node> mid(new Node());
+            mid->edge.assign(child->edge.begin(), child->edge.begin() + i);
+            mid->depth = pos + i;
+
+            std::unique_ptr<Node> rest = std::move(it->second);
+            rest->edge.erase(rest->edge.begin(), rest->edge.begin() + i);
+            mid->children[rest->edge[0]] = std::move(rest);
+
+            Node* raw = mid.get();
+            it->second = std::move(mid);
+            child = raw;
+        }
+
+        node = child;
+        pos += i;
+    }
+
+    if (!node->state.empty()) {
+        node->lastUsed = ++tick_;
+        return;
+    }
+
+    const size_t size = llama_state_seq_get_size(ctx, seq);
+    if (size > byteBudget_) {
+        pruneEmpty(root_.get());
+        return;
+    }
+    node->state.resize(size);
+    node->state.resize(llama_state_seq_get_data(ctx, node->state.data(), size, seq));
+    node->lastUsed = ++tick_;
+
+    stats_.inserts++;
+    stats_.entries++;
+    stats_.bytes += node->state.size();
+    evictToBudget();
+}
+
+void PrefixCache::evictToBudget() {
+    while (stats_.bytes > byteBudget_) {
+        Node* victim = oldestEntry(root_.get(), nullptr);
+        if (!victim) {
+            break;
+        }
+        stats_.bytes -= victim->state.size();
+        stats_.entries--;
+        stats_.evictions++;
+        std::vector<uint8_t>().swap(victim->state);
+    }
+    pruneEmpty(root_.get());
+}
+
+void PrefixCache::clear() {
+    root_.reset(new Node());
+    stats_.bytes = 0;
+    stats_.entries = 0;
+}
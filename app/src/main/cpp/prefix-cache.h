@@ -0,0 +1,62 @@
+#pragma once
+
+#include "llama.h"
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+// Radix tree over token ids mapping prompt prefixes to saved sequence state
+// (llama_state_seq_get_data blobs). A request restores the longest cached
+// prefix of its prompt into its own sequence and prefills only the rest.
+// Entries are evicted least-recently-used first once the blobs exceed the
+// byte budget. Not thread-safe: callers hold the owning model's mutex.
+class PrefixCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t reusedTokens = 0;
+        uint64_t inserts = 0;
+        uint64_t evictions = 0;
+        size_t bytes = 0;
+        size_t entries = 0;
+    };
+
+    explicit PrefixCache(size_t byteBudget = 128u << 20, size_t minTokens = 16);
+
+    // Restores the longest usable cached prefix of `tokens` into `seq`, which
+    // must be empty. Returns the number of tokens now in the sequence (0 on a miss).
+    // At least one token is always left for the caller to decode.
+    size_t restore(llama_context* ctx, const std::vector<llama_token>& tokens, llama_seq_id seq);
+
+    // Saves the state of `seq`, which must hold exactly tokens[0, n), as an entry
+    void insert(llama_context* ctx, const llama_token* tokens, size_t n, llama_seq_id seq);
+
+    void clear();
+
+    const Stats& stats() const { return stats_; }
+
+private:
+    struct Node {
+        std::vector<llama_token> edge; // tokens on the edge from the parent
+        std::map<llama_token, std::unique_ptr<Node>> children;
+        std::vector<uint8_t> state;    // empty if no prefix ends here
+        size_t depth = 0;              // prefix length at the end of `edge`
+        uint64_t lastUsed = 0;
+    };
+
+    // Most recently used node with state in the subtree of `node`
+    static Node* newestEntry(Node* node);
+    static Node* oldestEntry(Node* node, Node* best);
+    static bool pruneEmpty(Node* node);
+
+    void evictToBudget();
+
+    std::unique_ptr<Node> root_;
+    size_t byteBudget_;
+    size_t minTokens_;
+    uint64_t tick_ = 0;
+    Stats stats_;
+};
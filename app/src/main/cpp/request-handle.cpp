@@ -0,0 +1,47 @@
+#include "request-handle.h"
+#include "llama.h"
+
+bool CancelToken::expired() const {
+    return cancelled.load(std::memory_order_relaxed) || (deadlineUs > 0 && llama_time_us() > deadlineUs);
+}
+
+const char* CancelToken::reason() const {
+    return cancelled.load() ? "cancelled" : "deadline exceeded";
+}
+
+RequestRegistry& RequestRegistry::instance() {
+    static RequestRegistry registry;
+    return registry;
+}
+
+int64_t RequestRegistry::create(int64_t timeoutMs) {
+    auto token = std::make_shared<CancelToken>();
+    if (timeoutMs > 0) {
+        token->deadlineUs = llama_time_us() + timeoutMs * 1000;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const int64_t handle = nextHandle_++;
+    tokens_[handle] = std::move(token);
+    return handle;
+}
+
+std::shared_ptr<CancelToken> RequestRegistry::get(int64_t handle) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = tokens_.find(handle);
+    return it != tokens_.end() ? it->second : nullptr;
+}
+
+bool RequestRegistry::cancel(int64_t handle) {
+    std::shared_ptr<CancelToken> token = get(handle);
+    if (!token) {
+        return false;
+    }
+    token->cancel();
+    return true;
+}
+
+void RequestRegistry::release(int64_t handle) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tokens_.erase(handle);
+}
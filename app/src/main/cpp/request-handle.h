@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// Lets another thread stop a generation call, and stops it by itself once
+// an optional wall-clock deadline passes
+struct CancelToken {
+    std::atomic<bool> cancelled{false};
+    int64_t deadlineUs = 0; // llama_time_us() value, 0 for none
+
+    void cancel() { cancelled.store(true); }
+
+    // Cheap enough to poll from the abort callback between graph nodes
+    bool expired() const;
+
+    // Error text for a stopped request
+    const char* reason() const;
+};
+
+// Process-wide table of CancelTokens handed to Java as jlong handles
+class RequestRegistry {
+public:
+    static RequestRegistry& instance();
+
+    // timeoutMs <= 0 means no deadline. Handles start at 1.
+    int64_t create(int64_t timeoutMs);
+
+    // Returns nullptr for 0 or an unknown handle
+    std::shared_ptr<CancelToken> get(int64_t handle);
+
+    bool cancel(int64_t handle);
+    void release(int64_t handle);
+
+private:
+    RequestRegistry() = default;
+
+    std::mutex mutex_;
+    int64_t nextHandle_ = 1;
+    std::unordered_map<int64_t, std::shared_ptr<CancelToken>> tokens_;
+};
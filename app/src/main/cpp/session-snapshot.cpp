@@ -0,0 +1,218 @@
+#include "session-snapshot.h"
+#include "native-log.h"
+#include "asset-mmap.h"
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+namespace {
+
+const uint32_t SNAPSHOT_MAGIC = 0x534d4c4c; // "LLMS"
+const uint32_t SNAPSHOT_VERSION = 2;
+const uint32_t SNAPSHOT_VERSION_MODEL_SIZE = 1; // identified the model by llama_model_size()
+
+bool writeBytes(FILE* f, const void* data, size_t size) {
+    return size == 0 || fwrite(data, 1, size, f) == size;
+}
+
+bool writeU64(FILE* f, uint64_t v) {
+    return writeBytes(f, &v, sizeof(v));
+}
+
+bool writeString(FILE* f, const std::string& s) {
+    return writeU64(f, s.size()) && writeBytes(f, s.data(), s.size());
+}
+
+bool readBytes(FILE* f, void* data, size_t size) {
+    return size == 0 || fread(data, 1, size, f) == size;
+}
+
+bool readU64(FILE* f, uint64_t& v) {
+    return readBytes(f, &v, sizeof(v));
+}
+
+bool readString(FILE* f, std::string& s) {
+    uint64_t size = 0;
+    if (!readU64(f, size) || size > (1u << 30)) return false;
+    s.resize(size);
+    return readBytes(f, &s[0], size);
+}
+
+bool readSnapshot(FILE* f, SessionSnapshot& snapshot);
+
+} // namespace
+
+bool writeSnapshotFile(const std::string& path, const SessionSnapshot& snapshot) {
+    const std::string tmpPath = path + ".tmp";
+    FILE* f = fopen(tmpPath.c_str(), "wb");
+    if (!f) {
+        LOGE("Failed to open snapshot file: %s", tmpPath.c_str());
+        return false;
+    }
+
+    bool ok = writeBytes(f, &SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) &&
+              writeBytes(f, &SNAPSHOT_VERSION, sizeof(SNAPSHOT_VERSION)) &&
+              writeString(f, snapshot.modelHash) &&
+              writeU64(f, snapshot.messages.size());
+    for (const auto& message : snapshot.messages) {
+        ok = ok && writeString(f, message.role) && writeString(f, message.content);
+    }
+    ok = ok && writeString(f, snapshot.cachedText) &&
+         writeU64(f, snapshot.tokens.size()) &&
+         writeBytes(f, snapshot.tokens.data(), snapshot.tokens.size() * sizeof(llama_token)) &&
+         writeU64(f, snapshot.state.size()) &&
+         writeBytes(f, snapshot.state.data(), snapshot.state.size());
+
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        LOGE("Failed to write snapshot: %s", path.c_str());
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool readSnapshotFile(const std::string& path, SessionSnapshot& snapshot) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    bool ok = readSnapshot(f, snapshot);
+    fclose(f);
+    if (!ok) {
+        LOGE("Corrupt or incompatible snapshot: %s", path.c_str());
+    }
+    return ok;
+}
+
+bool readSnapshotRange(const FileRange& range, SessionSnapshot& snapshot) {
+    // Own a duplicate so fclose() leaves the range's descriptor open
+    int fd = dup(range.fd);
+    FILE* f = fd >= 0 ? fdopen(fd, "rb") : nullptr;
+    if (!f) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    bool ok = fseeko(f, (off_t) range.offset, SEEK_SET) == 0 && readSnapshot(f, snapshot);
+    fclose(f);
+    if (!ok) {
+        LOGE("Corrupt or incompatible snapshot range at offset %lld", (long long) range.offset);
+    }
+    return ok;
+}
+
+namespace {
+
+bool readSnapshot(FILE* f, SessionSnapshot& snapshot) {
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    uint64_t n_messages = 0;
+    bool ok = readBytes(f, &magic, sizeof(magic)) && magic == SNAPSHOT_MAGIC &&
+              readBytes(f, &version, sizeof(version));
+
+    // Older snapshots keep their history; without a model hash their KV state is never applied
+    uint64_t modelSize = 0;
+    snapshot.modelHash.clear();
+    if (ok && version == SNAPSHOT_VERSION) {
+        ok = readString(f, snapshot.modelHash);
+    } else if (ok && version == SNAPSHOT_VERSION_MODEL_SIZE) {
+        ok = readU64(f, modelSize);
+    } else {
+        ok = false;
+    }
+    ok = ok && readU64(f, n_messages) && n_messages < (1u << 20);
+
+    snapshot.messages.clear();
+    for (uint64_t i = 0; ok && i < n_messages; i++) {
+        ChatMessage message;
+        ok = readString(f, message.role) && readString(f, message.content);
+        snapshot.messages.push_back(std::move(message));
+    }
+
+    uint64_t n_tokens = 0;
+    uint64_t state_size = 0;
+    ok = ok && readString(f, snapshot.cachedText) &&
+         readU64(f, n_tokens) && n_tokens < (1u << 24);
+    if (ok) {
+        snapshot.tokens.resize(n_tokens);
+        ok = readBytes(f, snapshot.tokens.data(), n_tokens * sizeof(llama_token)) &&
+             readU64(f, state_size) && state_size < (1ull << 34);
+    }
+    if (ok) {
+        snapshot.state.resize(state_size);
+        ok = readBytes(f, snapshot.state.data(), state_size);
+    }
+    return ok;
+}
+
+} // namespace
+
+SnapshotWriter& SnapshotWriter::instance() {
+    static SnapshotWriter writer;
+    return writer;
+}
+
+SnapshotWriter::~SnapshotWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void SnapshotWriter::enqueue(const std::string& path, SessionSnapshot snapshot) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!thread_.joinable()) {
+            thread_ = std::thread(&SnapshotWriter::run, this);
+        }
+
+        bool replaced = false;
+        for (auto& item : queue_) {
+            if (item.first == path) {
+                item.second = std::move(snapshot);
+                replaced = true;
+                break;
+            }
+        }
+        if (!replaced) {
+            queue_.emplace_back(path, std::move(snapshot));
+        }
+    }
+    cv_.notify_all();
+}
+
+void SnapshotWriter::flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return queue_.empty() && !writing_; });
+}
+
+void SnapshotWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this] { return !queue_.empty() || stopping_; });
+        if (queue_.empty()) {
+            return;
+        }
+
+        auto item = std::move(queue_.front());
+        queue_.pop_front();
+        writing_ = true;
+
+        lock.unlock();
+        const int64_t t_start = llama_time_us();
+        if (writeSnapshotFile(item.first, item.second)) {
+            LOGI("Snapshot of %zu tokens written in %.1f ms: %s", item.second.tokens.size(),
+                 (llama_time_us() - t_start) / 1000.0, item.first.c_str());
+        }
+        lock.lock();
+
+        writing_ = false;
+        cv_.notify_all();
+    }
+}
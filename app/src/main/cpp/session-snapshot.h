@@ -0,0 +1,62 @@
+#pragma once
+
+#include "llama.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct FileRange;
+
+struct ChatMessage {
+    std::string role;
+    std::string content;
+};
+
+// Everything needed to resume a chat session without prefilling it again:
+// the history, the tokens in the KV cache and the sequence state itself
+// (from llama_state_seq_get_data).
+struct SessionSnapshot {
+    std::string modelHash; // ModelStore content hash of the model, to reject state from another model
+    std::vector<ChatMessage> messages;
+    std::string cachedText;
+    std::vector<llama_token> tokens;
+    std::vector<uint8_t> state;
+};
+
+// Writes through a temp file and rename so a crash never leaves a torn snapshot
+bool writeSnapshotFile(const std::string& path, const SessionSnapshot& snapshot);
+bool readSnapshotFile(const std::string& path, SessionSnapshot& snapshot);
+
+// Reads a snapshot stored at the start of a file range, e.g. a baked
+// system-prompt snapshot shipped as an uncompressed APK asset
+bool readSnapshotRange(const FileRange& range, SessionSnapshot& snapshot);
+
+// Background thread that writes snapshots in order. A newer snapshot for a
+// path replaces one that is still queued, so a burst of turns costs one write.
+class SnapshotWriter {
+public:
+    static SnapshotWriter& instance();
+
+    void enqueue(const std::string& path, SessionSnapshot snapshot);
+
+    // Blocks until every queued snapshot has been written
+    void flush();
+
+private:
+    SnapshotWriter() = default;
+    ~SnapshotWriter();
+
+    void run();
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::pair<std::string, SessionSnapshot>> queue_;
+    bool writing_ = false;
+    bool stopping_ = false;
+    std::thread thread_;
+};
@@ -0,0 +1,264 @@
+#include "speculative.h"
+#include "model-registry.h"
+#include "ngram-cache.h"
+#include "native-log.h"
+#include "prefill.h"
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+
+// Same tolerance as llama.cpp's speculative example: models of one family
+// may pad their vocabularies differently
+const int32_t MAX_VOCAB_SIZE_DIFFERENCE = 128;
+
+uint64_t hashNgram(const llama_token* tokens, int n) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (int i = 0; i < n; i++) {
+        h = (h ^ (uint32_t) tokens[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+} // namespace
+
+const char* draftKindName(DraftKind kind) {
+    switch (kind) {
+        case DRAFT_MODEL:         return "draft model";
+        case DRAFT_PROMPT_LOOKUP: return "prompt lookup";
+        case DRAFT_NGRAM_CACHE:   return "n-gram cache";
+        case DRAFT_NONE:
+        case DRAFT_KIND_COUNT:    break;
+    }
+    return "none";
+}
+
+bool vocabsCompatible(const llama_model* target, const llama_model* draft) {
+    const llama_vocab* vt = llama_model_get_vocab(target);
+    const llama_vocab* vd = llama_model_get_vocab(draft);
+
+    if (llama_vocab_type(vt) != llama_vocab_type(vd)) {
+        return false;
+    }
+    if (std::abs(llama_vocab_n_tokens(vt) - llama_vocab_n_tokens(vd)) > MAX_VOCAB_SIZE_DIFFERENCE) {
+        return false;
+    }
+    return llama_vocab_bos(vt) == llama_vocab_bos(vd) && llama_vocab_eos(vt) == llama_vocab_eos(vd);
+}
+
+std::unique_ptr<DraftModelSource> DraftModelSource::create(std::shared_ptr<LoadedModel> draftModel,
+                                                           int32_t targetVocabSize) {
+    llama_seq_id seq = draftModel->acquireSeq();
+    if (seq < 0) {
+        LOGI("Draft model has no free sequence, request runs without speculation");
+        return nullptr;
+    }
+    return std::unique_ptr<DraftModelSource>(new DraftModelSource(std::move(draftModel), seq, targetVocabSize));
+}
+
+DraftModelSource::DraftModelSource(std::shared_ptr<LoadedModel> draftModel, llama_seq_id seq, int32_t targetVocabSize)
+    : model_(std::move(draftModel)), seq_(seq), targetVocabSize_(targetVocabSize) {
+    sampler_ = llama_sampler_init_greedy();
+}
+
+DraftModelSource::~DraftModelSource() {
+    llama_sampler_free(sampler_);
+    std::lock_guard<std::mutex> lock(model_->mutex);
+    model_->releaseSeq(seq_);
+}
+
+DraftKind DraftModelSource::draft(const std::vector<llama_token>& history, int n_max, std::vector<llama_token>& out) {
+    if (n_max <= 0 || history.empty()) {
+        return DRAFT_NONE;
+    }
+
+    std::lock_guard<std::mutex> lock(model_->mutex);
+    llama_context* ctx = model_->ctx;
+    llama_memory_t mem = llama_get_memory(ctx);
+
+    if (history.size() + n_max >= llama_n_ctx(ctx)) {
+        return DRAFT_NONE;
+    }
+
+    // Keep what the draft sequence shares with the history; the last history
+    // token is always decoded again so its logits are current
+    size_t n_common = 0;
+    while (n_common < cached_.size() && n_common + 1 < history.size() && cached_[n_common] == history[n_common]) {
+        n_common++;
+    }
+    llama_memory_seq_rm(mem, seq_, (llama_pos) n_common, -1);
+    cached_.resize(n_common);
+
+    PrefillOptions prefill;
+    prefill.seq_id = seq_;
+    if (prefillTokens(ctx, history.data() + n_common, (int) (history.size() - n_common), (llama_pos) n_common,
+                      prefill) != PREFILL_OK) {
+        LOGE("Draft model failed to catch up with the request");
+        llama_memory_seq_rm(mem, seq_, -1, -1);
+        cached_.clear();
+        return DRAFT_NONE;
+    }
+    cached_ = history;
+
+    const llama_vocab* vocab = llama_model_get_vocab(model_->model);
+    const size_t n_start = out.size();
+    for (int i = 0; i < n_max; i++) {
+        const llama_token token = llama_sampler_sample(sampler_, ctx, -1);
+        if (llama_vocab_is_eog(vocab, token) || token >= targetVocabSize_) {
+            break;
+        }
+        out.push_back(token);
+
+        if (i + 1 < n_max) {
+            if (decodeToken(ctx, token, (llama_pos) cached_.size(), seq_) != 0) {
+                break;
+            }
+            cached_.push_back(token);
+        }
+    }
+
+    return out.size() > n_start ? DRAFT_MODEL : DRAFT_NONE;
+}
+
+void PromptLookupSource::indexUpTo(const std::vector<llama_token>& history, size_t end) {
+    if (indexed_ > end) {
+        // The history was cut back (a preempted request restarting)
+        for (auto& index : index_) {
+            index.clear();
+        }
+        indexed_ = 0;
+    }
+    for (; indexed_ < end; indexed_++) {
+        for (int n = NGRAM_MIN; n <= NGRAM_MAX && (size_t) n <= indexed_ + 1; n++) {
+            index_[n - NGRAM_MIN][hashNgram(&history[indexed_ + 1 - n], n)] = (uint32_t) indexed_;
+        }
+    }
+}
+
+DraftKind PromptLookupSource::draft(const std::vector<llama_token>& history, int n_max, std::vector<llama_token>& out) {
+    const size_t n_hist = history.size();
+    if (n_max <= 0 || n_hist < (size_t) NGRAM_MIN + 1) {
+        return DRAFT_NONE;
+    }
+
+    // The suffix itself must not be found, so only earlier n-grams are indexed
+    indexUpTo(history, n_hist - 1);
+
+    for (int n = std::min<int>(NGRAM_MAX, (int) n_hist - 1); n >= NGRAM_MIN; n--) {
+        const llama_token* suffix = &history[n_hist - n];
+        auto it = index_[n - NGRAM_MIN].find(hashNgram(suffix, n));
+        if (it == index_[n - NGRAM_MIN].end()) {
+            continue;
+        }
+
+        // Hashes can collide; check the match before trusting it
+        const size_t end = it->second;
+        if (!std::equal(suffix, suffix + n, &history[end + 1 - n])) {
+            continue;
+        }
+
+        const size_t n_copy = std::min((size_t) n_max, n_hist - 1 - end);
+        out.insert(out.end(), history.begin() + end + 1, history.begin() + end + 1 + n_copy);
+        return n_copy > 0 ? DRAFT_PROMPT_LOOKUP : DRAFT_NONE;
+    }
+    return DRAFT_NONE;
+}
+
+DraftKind NgramCacheSource::draft(const std::vector<llama_token>& history, int n_max, std::vector<llama_token>& out) {
+    return cache_->draft(history, n_max, out) > 0 ? DRAFT_NGRAM_CACHE : DRAFT_NONE;
+}
+
+void DraftChain::add(std::unique_ptr<DraftSource> source) {
+    if (source) {
+        sources_.push_back(std::move(source));
+    }
+}
+
+DraftKind DraftChain::draft(const std::vector<llama_token>& history, int n_max, std::vector<llama_token>& out) {
+    for (auto& source : sources_) {
+        DraftKind kind = source->draft(history, n_max, out);
+        if (kind != DRAFT_NONE) {
+            return kind;
+        }
+    }
+    return DRAFT_NONE;
+}
+
+void DraftChain::draftTree(const std::vector<llama_token>& history, int n_max, int maxBranches, DraftTree& tree) {
+    tree.clear();
+    maxBranches = std::min(maxBranches, DraftTree::MAX_BRANCHES);
+
+    std::vector<llama_token> chain;
+    for (auto& source : sources_) {
+        if (tree.n_branches >= maxBranches) {
+            break;
+        }
+        if (source->expensive() && tree.n_branches > 0) {
+            continue;
+        }
+        chain.clear();
+        DraftKind kind = source->draft(history, n_max, chain);
+        if (kind != DRAFT_NONE) {
+            tree.addBranch(chain, kind);
+        }
+    }
+}
+
+void DraftTree::clear() {
+    nodes.clear();
+    n_branches = 0;
+}
+
+bool DraftTree::addBranch(const std::vector<llama_token>& chain, DraftKind kind) {
+    if (n_branches >= MAX_BRANCHES) {
+        return false;
+    }
+
+    // Walk the shared prefix first so a redundant chain leaves no trace
+    const uint32_t all = (1u << n_branches) - 1;
+    size_t n_shared = 0;
+    int parent = -1;
+    for (; n_shared < chain.size(); n_shared++) {
+        const int c = child(parent, chain[n_shared], all);
+        if (c < 0) {
+            break;
+        }
+        parent = c;
+    }
+    if (n_shared == chain.size()) {
+        return false;
+    }
+
+    const uint32_t bit = 1u << n_branches++;
+    parent = -1;
+    for (size_t i = 0; i < chain.size(); i++) {
+        int c = i < n_shared ? child(parent, chain[i], all) : -1;
+        if (c < 0) {
+            nodes.push_back({chain[i], parent, (int) i, kind, 0});
+            c = (int) nodes.size() - 1;
+        }
+        nodes[c].branches |= bit;
+        parent = c;
+    }
+    return true;
+}
+
+int DraftTree::child(int parent, llama_token token, uint32_t alive) const {
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].parent == parent && nodes[i].token == token && (nodes[i].branches & alive)) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+void DraftLength::update(int n_drafted, int n_accepted) {
+    if (n_drafted <= 0) {
+        return;
+    }
+    if (n_accepted == n_drafted) {
+        n_ = std::min(n_ + 2, max_);
+    } else if (n_accepted * 2 < n_drafted) {
+        n_ = std::max(n_ - 1, min_);
+    }
+}
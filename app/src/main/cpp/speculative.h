@@ -0,0 +1,152 @@
+#pragma once
+
+#include "llama.h"
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+struct LoadedModel;
+class NgramCache;
+
+// Where a draft came from; acceptance is tracked per kind
+enum DraftKind {
+    DRAFT_NONE = -1,
+    DRAFT_MODEL = 0,
+    DRAFT_PROMPT_LOOKUP = 1,
+    DRAFT_NGRAM_CACHE = 2,
+    DRAFT_KIND_COUNT,
+};
+
+const char* draftKindName(DraftKind kind);
+
+// Proposes tokens likely to follow a sequence. The target model checks them
+// all in one decode, so every accepted token saves a full forward pass.
+class DraftSource {
+public:
+    virtual ~DraftSource() = default;
+
+    // `history` is the prompt and every sampled token, ending with the token
+    // about to be decoded. Appends at most `n_max` tokens to `out` and
+    // returns the kind that produced them, or DRAFT_NONE.
+    virtual DraftKind draft(const std::vector<llama_token>& history, int n_max, std::vector<llama_token>& out) = 0;
+
+    // Costly sources are skipped when a cheaper one already offered a draft
+    virtual bool expensive() const { return false; }
+};
+
+// Candidate continuations merged into a prefix tree. Each branch is a
+// complete draft from one source; branches that start alike share nodes,
+// so the target scores the common part only once.
+struct DraftTree {
+    static constexpr int MAX_BRANCHES = 8;
+
+    struct Node {
+        llama_token token;
+        int parent;        // index into nodes, -1 for a child of the undrafted root
+        int depth;         // 0 for the first drafted token
+        DraftKind kind;    // source of the branch that created the node
+        uint32_t branches; // bit b set if branch b passes through the node
+    };
+
+    std::vector<Node> nodes; // parents always come before their children
+    int n_branches = 0;
+
+    void clear();
+
+    // Merges `chain` in as a new branch. Returns false if it adds nothing,
+    // i.e. it is empty or a prefix of an existing branch.
+    bool addBranch(const std::vector<llama_token>& chain, DraftKind kind);
+
+    // Child of `parent` with `token` on one of the `alive` branches, or -1
+    int child(int parent, llama_token token, uint32_t alive) const;
+};
+
+// True if tokens of `draft` can be fed to `target` as they are
+bool vocabsCompatible(const llama_model* target, const llama_model* draft);
+
+// Greedy drafts from a small model of the same family (e.g. Qwen3-0.6B for a
+// larger Qwen3). The draft model keeps the request's history in its own
+// sequence, so each call only decodes the tokens accepted since the last one.
+class DraftModelSource : public DraftSource {
+public:
+    // Returns nullptr if the draft model has no free sequence
+    static std::unique_ptr<DraftModelSource> create(std::shared_ptr<LoadedModel> draftModel, int32_t targetVocabSize);
+    ~DraftModelSource() override;
+
+    DraftKind draft(const std::vector<llama_token>& history, int n_max, std::vector<llama_token>& out) override;
+    bool expensive() const override { return true; }
+
+private:
+    DraftModelSource(std::shared_ptr<LoadedModel> draftModel, llama_seq_id seq, int32_t targetVocabSize);
+
+    std::shared_ptr<LoadedModel> model_;
+    llama_seq_id seq_;
+    int32_t targetVocabSize_;
+    llama_sampler* sampler_;
+    std::vector<llama_token> cached_; // tokens in the draft sequence
+};
+
+// Draft-free speculation for outputs that copy from their input
+// (summaries, extraction, code edits). Indexes every n-gram of the history
+// and proposes whatever followed the latest earlier occurrence of the
+// history's current suffix, trying longer n-grams first.
+class PromptLookupSource : public DraftSource {
+public:
+    static constexpr int NGRAM_MIN = 2;
+    static constexpr int NGRAM_MAX = 4;
+
+    DraftKind draft(const std::vector<llama_token>& history, int n_max, std::vector<llama_token>& out) override;
+
+private:
+    // Indexes the n-grams ending before `end`
+    void indexUpTo(const std::vector<llama_token>& history, size_t end);
+
+    // Per n-gram length: hash of the n-gram -> position of its last token
+    std::unordered_map<uint64_t, uint32_t> index_[NGRAM_MAX - NGRAM_MIN + 1];
+    size_t indexed_ = 0;
+};
+
+// Drafts from the persistent n-gram table of earlier generations, for
+// phrasing that recurs across requests rather than within one
+class NgramCacheSource : public DraftSource {
+public:
+    explicit NgramCacheSource(std::shared_ptr<NgramCache> cache) : cache_(std::move(cache)) {}
+
+    DraftKind draft(const std::vector<llama_token>& history, int n_max, std::vector<llama_token>& out) override;
+
+private:
+    std::shared_ptr<NgramCache> cache_;
+};
+
+// Asks each source in turn and uses the first draft offered, so cheap
+// sources go first and a draft model only runs when they have nothing
+class DraftChain : public DraftSource {
+public:
+    void add(std::unique_ptr<DraftSource> source);
+    bool empty() const { return sources_.empty(); }
+
+    DraftKind draft(const std::vector<llama_token>& history, int n_max, std::vector<llama_token>& out) override;
+
+    // Collects up to `maxBranches` drafts of at most `n_max` tokens, one per
+    // source, as a tree. Expensive sources only run if nothing else drafted.
+    void draftTree(const std::vector<llama_token>& history, int n_max, int maxBranches, DraftTree& tree);
+
+private:
+    std::vector<std::unique_ptr<DraftSource>> sources_;
+};
+
+// Draft length that follows the acceptance rate: longer while whole drafts
+// are accepted, shorter while most of each draft is thrown away
+class DraftLength {
+public:
+    DraftLength(int n_min, int n_max) : min_(n_min), max_(n_max), n_((n_min + n_max) / 2) {}
+
+    int get() const { return n_; }
+    void update(int n_drafted, int n_accepted);
+
+private:
+    int min_;
+    int max_;
+    int n_;
+};
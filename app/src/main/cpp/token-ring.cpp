@@ -0,0 +1,84 @@
+#include "token-ring.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
+
+TokenRing* TokenRing::create(size_t capacity) {
+    size_t rounded = 64;
+    while (rounded < capacity) {
+        rounded <<= 1;
+    }
+
+    void* mem = nullptr;
+    if (posix_memalign(&mem, 64, HEADER_SIZE + rounded) != 0) {
+        return nullptr;
+    }
+
+    TokenRing* ring = new (mem) TokenRing();
+    ring->head_.store(0, std::memory_order_relaxed);
+    ring->tail_.store(0, std::memory_order_relaxed);
+    ring->state_.store(OPEN, std::memory_order_relaxed);
+    ring->capacity_ = (uint32_t) rounded;
+    return ring;
+}
+
+void TokenRing::destroy(TokenRing* ring) {
+    if (ring) {
+        ring->~TokenRing();
+        free(ring);
+    }
+}
+
+bool TokenRing::write(const char* src, size_t size) {
+    const uint64_t mask = capacity_ - 1;
+    uint64_t head = head_.load(std::memory_order_relaxed);
+
+    while (size > 0) {
+        if (state_.load(std::memory_order_acquire) == DETACHED) {
+            return false;
+        }
+
+        const uint64_t tail = tail_.load(std::memory_order_acquire);
+        const size_t space = capacity_ - (size_t) (head - tail);
+        if (space == 0) {
+            // The UI drains once per frame; back off instead of spinning a core
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+            continue;
+        }
+
+        const size_t n = std::min(size, space);
+        const size_t start = (size_t) (head & mask);
+        const size_t first = std::min(n, (size_t) capacity_ - start);
+        memcpy(data() + start, src, first);
+        memcpy(data(), src + first, n - first);
+
+        head += n;
+        head_.store(head, std::memory_order_release);
+        src += n;
+        size -= n;
+    }
+    return true;
+}
+
+void TokenRing::close(State state) {
+    uint32_t expected = OPEN;
+    state_.compare_exchange_strong(expected, state, std::memory_order_acq_rel);
+}
+
+size_t TokenRing::read(char* dst, size_t maxSize) {
+    const uint64_t mask = capacity_ - 1;
+    const uint64_t tail = tail_.load(std::memory_order_relaxed);
+    const uint64_t head = head_.load(std::memory_order_acquire);
+
+    const size_t n = std::min(maxSize, (size_t) (head - tail));
+    const size_t start = (size_t) (tail & mask);
+    const size_t first = std::min(n, (size_t) capacity_ - start);
+    memcpy(dst, data() + start, first);
+    memcpy(dst + first, data(), n - first);
+
+    tail_.store(tail + n, std::memory_order_release);
+    return n;
+}
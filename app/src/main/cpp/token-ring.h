@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Lock-free single-producer/single-consumer byte ring shared with Kotlin.
+//
+// The header and the data live in one native allocation that Kotlin sees as
+// a direct ByteBuffer, so the consumer polls it with plain memory reads and
+// no JNI calls. Layout (native byte order):
+//
+//   offset   0  uint64 head      total bytes written, stored with release by the producer
+//   offset  64  uint64 tail      total bytes read, stored with release by the consumer
+//   offset 128  uint32 state     TokenRing::State
+//   offset 132  uint32 capacity  size of the data area, a power of two
+//   offset 192  data[capacity]
+class TokenRing {
+public:
+    enum State : uint32_t {
+        OPEN = 0,
+        FINISHED = 1,  // producer is done, drain what is left
+        FAILED = 2,    // producer stopped on an error
+        DETACHED = 3,  // consumer went away, producer should stop
+    };
+
+    static constexpr size_t HEADER_SIZE = 192;
+
+    // Capacity is rounded up to a power of two. Returns nullptr on allocation failure.
+    static TokenRing* create(size_t capacity);
+    static void destroy(TokenRing* ring);
+
+    // The ring whose shared buffer starts at `address` (from GetDirectBufferAddress)
+    static TokenRing* fromAddress(void* address) { return static_cast<TokenRing*>(address); }
+
+    void* address() { return this; }
+    size_t totalSize() const { return HEADER_SIZE + capacity_; }
+
+    // Producer side. Waits for the consumer while the ring is full; returns
+    // false without writing if the consumer has detached.
+    bool write(const char* data, size_t size);
+    void close(State state);
+
+    // Consumer side, for native readers
+    size_t read(char* dst, size_t maxSize);
+
+    State state() const { return (State) state_.load(std::memory_order_acquire); }
+
+private:
+    TokenRing() = default;
+
+    uint8_t* data() { return reinterpret_cast<uint8_t*>(this) + HEADER_SIZE; }
+
+    alignas(64) std::atomic<uint64_t> head_;
+    alignas(64) std::atomic<uint64_t> tail_;
+    alignas(64) std::atomic<uint32_t> state_;
+    uint32_t capacity_;
+};
+
+static_assert(sizeof(std::atomic<uint64_t>) == 8, "ring header layout is shared with Kotlin");
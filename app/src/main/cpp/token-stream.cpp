@@ -0,0 +1,54 @@
+#include "token-stream.h"
+#include "llama.h"
+
+size_t completeUtf8Length(const char* data, size_t size) {
+    // Walk back over at most 3 continuation bytes to the last lead byte
+    size_t i = size;
+    size_t continuation = 0;
+    while (i > 0 && continuation < 4) {
+        const unsigned char c = (unsigned char) data[i - 1];
+        if ((c & 0xC0) != 0x80) {
+            size_t expected = 1;
+            if ((c & 0xE0) == 0xC0) expected = 2;
+            else if ((c & 0xF0) == 0xE0) expected = 3;
+            else if ((c & 0xF8) == 0xF0) expected = 4;
+            return (continuation + 1 >= expected) ? size : i - 1;
+        }
+        continuation++;
+        i--;
+    }
+    return size;
+}
+
+DeltaBatcher::DeltaBatcher(FlushFn flush, size_t maxBytes, int64_t maxDelayUs)
+        : flush_(std::move(flush)), maxBytes_(maxBytes), maxDelayUs_(maxDelayUs), lastFlushUs_(llama_time_us()) {
+}
+
+void DeltaBatcher::append(const char* data, size_t size) {
+    pending_.append(data, size);
+    flush(false);
+}
+
+void DeltaBatcher::finish() {
+    flush(true);
+}
+
+void DeltaBatcher::flush(bool force) {
+    if (pending_.empty()) {
+        return;
+    }
+
+    const int64_t now = llama_time_us();
+    if (!force && pending_.size() < maxBytes_ && now - lastFlushUs_ < maxDelayUs_) {
+        return;
+    }
+
+    const size_t n = force ? pending_.size() : completeUtf8Length(pending_.data(), pending_.size());
+    if (n == 0) {
+        return;
+    }
+
+    flush_(pending_.substr(0, n));
+    pending_.erase(0, n);
+    lastFlushUs_ = now;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+// Length of the longest prefix of `data` that does not end inside a UTF-8 sequence
+size_t completeUtf8Length(const char* data, size_t size);
+
+// Coalesces detokenized pieces into larger deltas so the consumer is invoked
+// every few tokens instead of on every one. A delta is emitted once it holds
+// at least `maxBytes` bytes or `maxDelayUs` has passed since the last one,
+// and never splits a multi-byte UTF-8 character.
+class DeltaBatcher {
+public:
+    using FlushFn = std::function<void(const std::string& delta)>;
+
+    explicit DeltaBatcher(FlushFn flush, size_t maxBytes = 32, int64_t maxDelayUs = 50000);
+
+    void append(const char* data, size_t size);
+
+    // Emits whatever is pending, including an incomplete trailing sequence
+    void finish();
+
+private:
+    void flush(bool force);
+
+    FlushFn flush_;
+    size_t maxBytes_;
+    int64_t maxDelayUs_;
+    int64_t lastFlushUs_;
+    std::string pending_;
+};
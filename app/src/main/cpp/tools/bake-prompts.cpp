@@ -0,0 +1,139 @@
+// Host tool: prefills fixed system prompts and writes their KV state as
+// snapshots the app loads instead of prefilling (see baked-prompts.h).
+//
+// Usage: bake-prompts <model.gguf> <assets-dir> <prompt.txt>...
+//
+// Each prompt file holds one system prompt; a single trailing newline is
+// dropped. Output goes to <assets-dir>/kv/<model hash>/<prompt hash>.kvs.
+// Bake with the same llama.cpp version the app ships, since the state
+// layout is not stable across versions.
+
+#include "llama.h"
+#include "baked-prompts.h"
+#include "chat-session.h"
+#include "content-hash.h"
+#include "model-registry.h"
+#include "prefill.h"
+#include "session-snapshot.h"
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+namespace {
+
+bool readPromptFile(const std::string& path, std::string& out) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    std::stringstream ss;
+    ss << in.rdbuf();
+    out = ss.str();
+    if (!out.empty() && out.back() == '\n') {
+        out.pop_back();
+    }
+    return true;
+}
+
+bool makeDirs(const std::string& path) {
+    for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+        const std::string dir = path.substr(0, pos);
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+        if (pos == std::string::npos) {
+            return true;
+        }
+    }
+}
+
+bool bakePrompt(LoadedModel& loaded, const std::string& modelHash, const std::string& systemPrompt,
+                const std::string& assetsDir) {
+    const llama_vocab* vocab = llama_model_get_vocab(loaded.model);
+
+    SessionSnapshot snapshot;
+    snapshot.modelHash = modelHash;
+    snapshot.messages.push_back({"system", systemPrompt});
+    // Must match what ChatSession caches for the same history
+    snapshot.cachedText = formatChatMessages(loaded.model, snapshot.messages, false);
+    snapshot.tokens = tokenizeText(vocab, snapshot.cachedText, true, true);
+
+    std::lock_guard<std::mutex> lock(loaded.mutex);
+    SeqGuard seq(loaded);
+    if (seq.id < 0) {
+        fprintf(stderr, "No free sequence\n");
+        return false;
+    }
+
+    PrefillOptions prefill;
+    prefill.seq_id = seq.id;
+    prefill.logits_last = false;
+    PrefillStatus status = prefillTokens(loaded.ctx, snapshot.tokens.data(), (int) snapshot.tokens.size(), 0, prefill);
+    if (status != PREFILL_OK) {
+        fprintf(stderr, "%s\n", prefillStatusMessage(status));
+        return false;
+    }
+
+    snapshot.state.resize(llama_state_seq_get_size(loaded.ctx, seq.id));
+    snapshot.state.resize(llama_state_seq_get_data(loaded.ctx, snapshot.state.data(), snapshot.state.size(), seq.id));
+
+    const std::string outPath = assetsDir + "/" + bakedPromptAssetPath(modelHash, systemPrompt);
+    const std::string outDir = outPath.substr(0, outPath.find_last_of('/'));
+    if (!makeDirs(outDir) || !writeSnapshotFile(outPath, snapshot)) {
+        fprintf(stderr, "Failed to write %s\n", outPath.c_str());
+        return false;
+    }
+
+    printf("%s: %zu tokens, %zu bytes of state\n", outPath.c_str(), snapshot.tokens.size(), snapshot.state.size());
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <model.gguf> <assets-dir> <prompt.txt>...\n", argv[0]);
+        return 1;
+    }
+    const std::string modelPath = argv[1];
+    const std::string assetsDir = argv[2];
+
+    // The app looks blobs up by the ModelStore hash of the installed model
+    const std::string modelHash = hashFile(modelPath);
+    if (modelHash.empty()) {
+        fprintf(stderr, "Failed to hash %s\n", modelPath.c_str());
+        return 1;
+    }
+
+    llama_backend_init();
+
+    int failed = 0;
+    {
+        std::shared_ptr<LoadedModel> loaded = ModelRegistry::instance().acquire(modelPath);
+        if (!loaded) {
+            fprintf(stderr, "Failed to load %s\n", modelPath.c_str());
+            llama_backend_free();
+            return 1;
+        }
+
+        for (int i = 3; i < argc; i++) {
+            std::string systemPrompt;
+            if (!readPromptFile(argv[i], systemPrompt)) {
+                fprintf(stderr, "Failed to read %s\n", argv[i]);
+                failed++;
+                continue;
+            }
+            if (!bakePrompt(*loaded, modelHash, systemPrompt, assetsDir)) {
+                failed++;
+            }
+        }
+    }
+
+    ModelRegistry::instance().unloadAll();
+    llama_backend_free();
+    return failed == 0 ? 0 : 1;
+}
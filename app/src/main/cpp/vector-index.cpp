@@ -0,0 +1,503 @@
+#include "vector-index.h"
+#include "ggml-cpu.h"
+#include "llama.h"
+#include "native-log.h"
+#include <algorithm>
+#include <cmath>
+#include <fcntl.h>
+#include <queue>
+#include <random>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+const uint32_t VECTOR_INDEX_MAGIC = 0x564d4c4c; // "LLMV"
+const uint32_t VECTOR_INDEX_VERSION = 1;
+
+const uint64_t INITIAL_CAPACITY = 1024;
+
+// Values per Q8_0 block; each block stores an fp16 scale and one int8 per value
+const int QK8_0 = 32;
+
+// Below this many rows per thread, starting threads costs more than it saves
+const uint64_t MIN_ROWS_PER_THREAD = 2048;
+
+size_t rowSize(ggml_type type, int dim) {
+    if (type == GGML_TYPE_Q8_0) {
+        return (size_t) (dim / QK8_0) * (sizeof(ggml_fp16_t) + QK8_0);
+    }
+    return (size_t) dim * sizeof(ggml_fp16_t);
+}
+
+// Orders a heap so its front is the worst hit
+bool betterHit(const VectorIndex::Hit& a, const VectorIndex::Hit& b) {
+    return a.score > b.score;
+}
+
+} // namespace
+
+struct VectorIndex::Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t type; // ggml_type of the rows
+    uint32_t dim;
+    uint64_t count;
+    uint64_t capacity; // rows the file has room for
+    uint8_t reserved[32];
+};
+
+// Hierarchical navigable small world graph over the index's rows. Every
+// row is a node with up to M neighbours per level (2M on level 0); search
+// descends greedily from the sparse top levels and then explores level 0
+// with a beam of efSearch candidates.
+class VectorIndex::Graph {
+public:
+    Graph(const VectorIndex& index, int M, int efConstruction, int efSearch)
+        : index_(index), M_(std::max(2, M)), efConstruction_(std::max(M_, efConstruction)),
+          efSearch_(std::max(1, efSearch)), levelMult_(1.0 / std::log((double) M_)) {}
+
+    void insert(uint32_t node);
+    std::vector<Hit> search(const void* query, int k);
+
+private:
+    using Scored = std::pair<float, uint32_t>;
+
+    uint32_t greedy(const void* query, uint32_t entry, int level) const;
+    std::vector<Scored> searchLayer(const void* query, uint32_t entry, int ef, int level);
+    void connect(uint32_t node, uint32_t neighbour, int level);
+
+    const VectorIndex& index_;
+    const int M_;
+    const int efConstruction_;
+    const int efSearch_;
+    const double levelMult_;
+
+    std::vector<std::vector<std::vector<uint32_t>>> links_; // node -> level -> neighbours
+    int64_t entry_ = -1;
+    int maxLevel_ = -1;
+    std::mt19937 rng_{1337};
+
+    std::vector<uint32_t> visited_; // epoch of the last search that saw each node
+    uint32_t epoch_ = 0;
+};
+
+uint32_t VectorIndex::Graph::greedy(const void* query, uint32_t entry, int level) const {
+    uint32_t cur = entry;
+    float best = index_.score(index_.row(cur), query);
+    for (bool moved = true; moved;) {
+        moved = false;
+        for (uint32_t n : links_[cur][level]) {
+            const float s = index_.score(index_.row(n), query);
+            if (s > best) {
+                best = s;
+                cur = n;
+                moved = true;
+            }
+        }
+    }
+    return cur;
+}
+
+std::vector<VectorIndex::Graph::Scored> VectorIndex::Graph::searchLayer(const void* query, uint32_t entry, int ef,
+                                                                        int level) {
+    visited_.resize(links_.size(), 0);
+    if (++epoch_ == 0) {
+        std::fill(visited_.begin(), visited_.end(), 0);
+        epoch_ = 1;
+    }
+
+    // Candidates to expand, best first, and the ef best found, worst first
+    std::priority_queue<Scored> candidates;
+    std::priority_queue<Scored, std::vector<Scored>, std::greater<Scored>> found;
+
+    const float s0 = index_.score(index_.row(entry), query);
+    candidates.push({s0, entry});
+    found.push({s0, entry});
+    visited_[entry] = epoch_;
+
+    while (!candidates.empty()) {
+        const Scored c = candidates.top();
+        if ((int) found.size() >= ef && c.first < found.top().first) {
+            break;
+        }
+        candidates.pop();
+
+        for (uint32_t n : links_[c.second][level]) {
+            if (visited_[n] == epoch_) {
+                continue;
+            }
+            visited_[n] = epoch_;
+            const float s = index_.score(index_.row(n), query);
+            if ((int) found.size() < ef || s > found.top().first) {
+                candidates.push({s, n});
+                found.push({s, n});
+                if ((int) found.size() > ef) {
+                    found.pop();
+                }
+            }
+        }
+    }
+
+    std::vector<Scored> out(found.size());
+    for (size_t i = out.size(); i-- > 0;) {
+        out[i] = found.top();
+        found.pop();
+    }
+    return out;
+}
+
+void VectorIndex::Graph::connect(uint32_t node, uint32_t neighbour, int level) {
+    std::vector<uint32_t>& list = links_[node][level];
+    list.push_back(neighbour);
+
+    const size_t maxLinks = level == 0 ? 2 * M_ : M_;
+    if (list.size() <= maxLinks) {
+        return;
+    }
+
+    // Keep the closest
+    const void* origin = index_.row(node);
+    std::vector<Scored> scored;
+    scored.reserve(list.size());
+    for (uint32_t n : list) {
+        scored.push_back({index_.score(index_.row(n), origin), n});
+    }
+    std::partial_sort(scored.begin(), scored.begin() + maxLinks, scored.end(), std::greater<Scored>());
+    list.clear();
+    for (size_t i = 0; i < maxLinks; i++) {
+        list.push_back(scored[i].second);
+    }
+}
+
+void VectorIndex::Graph::insert(uint32_t node) {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    const int level = (int) std::floor(-std::log(1.0 - uniform(rng_)) * levelMult_);
+
+    links_.resize(std::max<size_t>(links_.size(), node + 1));
+    links_[node].resize(level + 1);
+    if (entry_ < 0) {
+        entry_ = node;
+        maxLevel_ = level;
+        return;
+    }
+
+    const void* query = index_.row(node);
+    uint32_t cur = (uint32_t) entry_;
+    for (int l = maxLevel_; l > level; l--) {
+        cur = greedy(query, cur, l);
+    }
+    for (int l = std::min(level, maxLevel_); l >= 0; l--) {
+        const std::vector<Scored> found = searchLayer(query, cur, efConstruction_, l);
+        for (size_t i = 0; i < found.size() && (int) i < M_; i++) {
+            connect(node, found[i].second, l);
+            connect(found[i].second, node, l);
+        }
+        cur = found.front().second;
+    }
+
+    if (level > maxLevel_) {
+        entry_ = node;
+        maxLevel_ = level;
+    }
+}
+
+std::vector<VectorIndex::Hit> VectorIndex::Graph::search(const void* query, int k) {
+    std::vector<Hit> hits;
+    if (entry_ < 0) {
+        return hits;
+    }
+
+    uint32_t cur = (uint32_t) entry_;
+    for (int l = maxLevel_; l > 0; l--) {
+        cur = greedy(query, cur, l);
+    }
+    for (const Scored& s : searchLayer(query, cur, std::max(efSearch_, k), 0)) {
+        if ((int) hits.size() >= k) {
+            break;
+        }
+        hits.push_back({(int64_t) s.second, s.first});
+    }
+    return hits;
+}
+
+VectorIndex::VectorIndex() = default;
+
+VectorIndex::~VectorIndex() {
+    close();
+}
+
+bool VectorIndex::open(const std::string& path, int dim, ggml_type type) {
+    static_assert(sizeof(Header) == 64, "header must stay 64 bytes");
+
+    // Fills the fp16 tables the conversions below rely on; cheap after the first call
+    ggml_cpu_init();
+
+    if (dim <= 0) {
+        LOGE("Vector index dimension must be positive, got %d", dim);
+        return false;
+    }
+    if (type != GGML_TYPE_Q8_0 && type != GGML_TYPE_F16) {
+        LOGE("Vector index rows must be Q8_0 or F16");
+        return false;
+    }
+    if (type == GGML_TYPE_Q8_0 && dim % QK8_0 != 0) {
+        LOGI("Dimension %d is not a multiple of %d, storing the vector index as F16", dim, QK8_0);
+        type = GGML_TYPE_F16;
+    }
+
+    close();
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd_ < 0) {
+        LOGE("Failed to open vector index: %s", path.c_str());
+        return false;
+    }
+
+    struct stat st;
+    Header header = {};
+    const bool fresh = fstat(fd_, &st) == 0 && st.st_size == 0;
+    if (!fresh) {
+        // Unlike a cache, an index holds the caller's data: never overwrite one that does not match
+        if (pread(fd_, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+            header.magic != VECTOR_INDEX_MAGIC || header.version != VECTOR_INDEX_VERSION) {
+            LOGE("Not a vector index: %s", path.c_str());
+            ::close(fd_);
+            fd_ = -1;
+            return false;
+        }
+        if ((int) header.dim != dim) {
+            LOGE("Vector index %s holds %u-dimensional rows, not %d", path.c_str(), header.dim, dim);
+            ::close(fd_);
+            fd_ = -1;
+            return false;
+        }
+        type = (ggml_type) header.type;
+        if (type != GGML_TYPE_Q8_0 && type != GGML_TYPE_F16) {
+            LOGE("Vector index %s has unsupported row type %u", path.c_str(), header.type);
+            ::close(fd_);
+            fd_ = -1;
+            return false;
+        }
+    }
+
+    dim_ = dim;
+    type_ = type;
+    rowBytes_ = rowSize(type_, dim_);
+    path_ = path;
+
+    if (!remap(fresh ? INITIAL_CAPACITY : header.capacity)) {
+        ::close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    if (fresh) {
+        header_->magic = VECTOR_INDEX_MAGIC;
+        header_->version = VECTOR_INDEX_VERSION;
+        header_->type = (uint32_t) type_;
+        header_->dim = (uint32_t) dim_;
+        header_->count = 0;
+        header_->capacity = INITIAL_CAPACITY;
+        LOGI("Created vector index: %s", path.c_str());
+    } else {
+        LOGI("Opened vector index with %llu rows: %s", (unsigned long long) header_->count, path.c_str());
+    }
+    return true;
+}
+
+void VectorIndex::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    graph_.reset();
+    if (map_) {
+        msync(map_, mapSize_, MS_ASYNC);
+        munmap(map_, mapSize_);
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+    fd_ = -1;
+    map_ = nullptr;
+    mapSize_ = 0;
+    header_ = nullptr;
+    rows_ = nullptr;
+}
+
+bool VectorIndex::remap(uint64_t capacity) {
+    const size_t size = sizeof(Header) + (size_t) capacity * rowBytes_;
+
+    // The old mapping stays until the new one exists, so a failed grow
+    // leaves the index usable at its current size
+    struct stat st;
+    if (fstat(fd_, &st) != 0 || ((size_t) st.st_size < size && ftruncate(fd_, (off_t) size) != 0)) {
+        LOGE("Failed to size vector index: %s", path_.c_str());
+        return false;
+    }
+
+    void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (map == MAP_FAILED) {
+        LOGE("Failed to map vector index: %s", path_.c_str());
+        return false;
+    }
+
+    if (map_) {
+        munmap(map_, mapSize_);
+    }
+    map_ = map;
+    mapSize_ = size;
+    header_ = (Header*) map;
+    rows_ = (uint8_t*) map + sizeof(Header);
+    return true;
+}
+
+const uint8_t* VectorIndex::row(uint64_t i) const {
+    return rows_ + i * rowBytes_;
+}
+
+float VectorIndex::score(const void* a, const void* b) const {
+    // Rows are stored in their type's vec_dot type, so any two rows, or a
+    // row and a converted query, can be multiplied directly
+    float s = 0.0f;
+    ggml_get_type_traits_cpu(type_)->vec_dot(dim_, &s, 0, a, 0, b, 0, 1);
+    return s;
+}
+
+size_t VectorIndex::size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return header_ ? (size_t) header_->count : 0;
+}
+
+int64_t VectorIndex::add(const float* vectors, size_t n) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!header_) {
+        return -1;
+    }
+
+    const uint64_t first = header_->count;
+    if (first + n > header_->capacity) {
+        const uint64_t capacity = std::max<uint64_t>(header_->capacity * 2, first + n);
+        if (!remap(capacity)) {
+            return -1;
+        }
+        header_->capacity = capacity;
+    }
+
+    const ggml_from_float_t fromFloat = ggml_get_type_traits_cpu(type_)->from_float;
+    for (size_t i = 0; i < n; i++) {
+        fromFloat(vectors + i * (size_t) dim_, rows_ + (first + i) * rowBytes_, dim_);
+    }
+    // Counted only once written, so a crash never exposes a half-written row
+    header_->count = first + n;
+
+    if (graph_) {
+        for (size_t i = 0; i < n; i++) {
+            graph_->insert((uint32_t) (first + i));
+        }
+    }
+    return (int64_t) first;
+}
+
+std::vector<VectorIndex::Hit> VectorIndex::scan(const void* query, int k, int n_threads) {
+    const uint64_t n_rows = header_->count;
+    n_threads = (int) std::max<uint64_t>(1, std::min<uint64_t>(n_threads, n_rows / MIN_ROWS_PER_THREAD));
+
+    // Every thread keeps its own top k over a contiguous slice
+    std::vector<std::vector<Hit>> partial(n_threads);
+    auto worker = [&](int t) {
+        std::vector<Hit>& heap = partial[t];
+        const uint64_t begin = n_rows * t / n_threads;
+        const uint64_t end = n_rows * (t + 1) / n_threads;
+        for (uint64_t i = begin; i < end; i++) {
+            const float s = score(row(i), query);
+            if ((int) heap.size() < k) {
+                heap.push_back({(int64_t) i, s});
+                std::push_heap(heap.begin(), heap.end(), betterHit);
+            } else if (s > heap.front().score) {
+                std::pop_heap(heap.begin(), heap.end(), betterHit);
+                heap.back() = {(int64_t) i, s};
+                std::push_heap(heap.begin(), heap.end(), betterHit);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < n_threads; t++) {
+        threads.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::vector<Hit> hits;
+    for (const auto& heap : partial) {
+        hits.insert(hits.end(), heap.begin(), heap.end());
+    }
+    const size_t n_best = std::min(hits.size(), (size_t) k);
+    std::partial_sort(hits.begin(), hits.begin() + n_best, hits.end(), betterHit);
+    hits.resize(n_best);
+    return hits;
+}
+
+std::vector<VectorIndex::Hit> VectorIndex::search(const float* query, int k, int n_threads) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!header_ || k <= 0 || header_->count == 0) {
+        return {};
+    }
+
+    // The query takes the rows' format so vec_dot runs on both as they are
+    std::vector<uint8_t> converted(rowBytes_);
+    ggml_get_type_traits_cpu(type_)->from_float(query, converted.data(), dim_);
+
+    const int64_t t_start = llama_time_us();
+    std::vector<Hit> hits = graph_ ? graph_->search(converted.data(), k) : scan(converted.data(), k, n_threads);
+    LOGI("Vector search over %llu rows (%s) took %.2f ms", (unsigned long long) header_->count,
+         graph_ ? "graph" : "scan", (llama_time_us() - t_start) / 1000.0);
+    return hits;
+}
+
+void VectorIndex::setGraph(bool enabled, int M, int efConstruction, int efSearch) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    graph_.reset();
+    if (!enabled || !header_) {
+        return;
+    }
+
+    const int64_t t_start = llama_time_us();
+    graph_.reset(new Graph(*this, M, efConstruction, efSearch));
+    for (uint64_t i = 0; i < header_->count; i++) {
+        graph_->insert((uint32_t) i);
+    }
+    LOGI("Built vector index graph over %llu rows in %.1f ms", (unsigned long long) header_->count,
+         (llama_time_us() - t_start) / 1000.0);
+}
+
+VectorIndexManager& VectorIndexManager::instance() {
+    static VectorIndexManager manager;
+    return manager;
+}
+
+int64_t VectorIndexManager::open(const std::string& path, int dim, ggml_type type) {
+    auto index = std::make_shared<VectorIndex>();
+    if (!index->open(path, dim, type)) {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const int64_t handle = nextHandle_++;
+    indexes_[handle] = std::move(index);
+    return handle;
+}
+
+std::shared_ptr<VectorIndex> VectorIndexManager::get(int64_t handle) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = indexes_.find(handle);
+    return it != indexes_.end() ? it->second : nullptr;
+}
+
+bool VectorIndexManager::close(int64_t handle) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return indexes_.erase(handle) > 0;
+}
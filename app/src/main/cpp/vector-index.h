@@ -0,0 +1,92 @@
+#pragma once
+
+#include "ggml.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Nearest-neighbour search over embeddings, stored as Q8_0 (about a
+// quarter of fp32) or fp16 rows in a memory-mapped file, so an index of any
+// size opens instantly and its pages load on demand. Scores are dot
+// products computed with ggml's SIMD vec_dot for the row type, i.e. cosine
+// similarities for the unit-length vectors EmbeddingEngine produces.
+//
+// Search scans every row on several threads by default. For larger corpora
+// an HNSW graph can be enabled; it lives in memory only and is rebuilt from
+// the rows when the index is opened again.
+class VectorIndex {
+public:
+    struct Hit {
+        int64_t row;
+        float score;
+    };
+
+    VectorIndex();
+    VectorIndex(const VectorIndex&) = delete;
+    VectorIndex& operator=(const VectorIndex&) = delete;
+    ~VectorIndex();
+
+    // Maps `path`, creating an empty index of `dim`-dimensional rows of
+    // `type` (GGML_TYPE_Q8_0 or GGML_TYPE_F16) if the file is new. An
+    // existing index keeps its own type; false if its dimension differs or
+    // the file is not an index.
+    bool open(const std::string& path, int dim, ggml_type type = GGML_TYPE_Q8_0);
+    void close();
+
+    int dimension() const { return dim_; }
+    size_t size();
+
+    // Appends `n` vectors of dimension() floats; returns the row of the
+    // first one, or -1 on failure. Rows are numbered in insertion order.
+    int64_t add(const float* vectors, size_t n);
+
+    // The `k` best rows for `query`, best first
+    std::vector<Hit> search(const float* query, int k, int n_threads = 4);
+
+    // Turns the HNSW graph on (building it over the current rows) or off
+    void setGraph(bool enabled, int M = 16, int efConstruction = 100, int efSearch = 64);
+
+private:
+    struct Header;
+    class Graph;
+
+    bool remap(uint64_t capacity);
+    const uint8_t* row(uint64_t i) const;
+    float score(const void* a, const void* b) const;
+    std::vector<Hit> scan(const void* query, int k, int n_threads);
+
+    std::mutex mutex_;
+    std::string path_;
+    int fd_ = -1;
+    void* map_ = nullptr;
+    size_t mapSize_ = 0;
+    Header* header_ = nullptr;
+    uint8_t* rows_ = nullptr;
+
+    int dim_ = 0;
+    ggml_type type_ = GGML_TYPE_Q8_0;
+    size_t rowBytes_ = 0;
+    std::unique_ptr<Graph> graph_;
+};
+
+// Process-wide table of open indexes handed to Java as jlong handles
+class VectorIndexManager {
+public:
+    static VectorIndexManager& instance();
+
+    // Returns 0 if the index cannot be opened. Handles start at 1.
+    int64_t open(const std::string& path, int dim, ggml_type type);
+    std::shared_ptr<VectorIndex> get(int64_t handle);
+    bool close(int64_t handle);
+
+private:
+    VectorIndexManager() = default;
+
+    std::mutex mutex_;
+    int64_t nextHandle_ = 1;
+    std::unordered_map<int64_t, std::shared_ptr<VectorIndex>> indexes_;
+};
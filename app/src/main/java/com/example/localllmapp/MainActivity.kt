@@ -17,9 +17,12 @@ import com.google.android.gms.auth.api.signin.GoogleSignInOptions
 import com.google.firebase.auth.FirebaseAuth
 import kotlinx.coroutines.CoroutineScope
 import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.NonCancellable
+import kotlinx.coroutines.async
+import kotlinx.coroutines.delay
 import kotlinx.coroutines.launch
 import kotlinx.coroutines.withContext
-import java.io.File
+import java.nio.ByteBuffer
 
 
 class MainActivity : AppCompatActivity() {
@@ -32,9 +35,90 @@ class MainActivity : AppCompatActivity() {
         }
     }
 
-    external fun runTextOnlyLlama(prompt: String, modelPath: String): String
+    // `request` is a handle from createRequest(), or 0 for a call that cannot be cancelled
+    external fun runTextOnlyLlama(prompt: String, modelPath: String, request: Long): String
+    external fun runTextStreaming(prompt: String, modelPath: String, listener: TokenListener, request: Long): String
+    // n different completions of one prompt (without the prompt) for the price of one prefill;
+    // decoded side by side, so much cheaper than n separate calls
+    external fun runTextAlternatives(prompt: String, modelPath: String, n: Int, request: Long): Array<String>
+    // Deterministic beam search for short outputs (titles, labels, translations); returns prompt + output
+    external fun runTextBeamSearch(prompt: String, modelPath: String, beamWidth: Int, maxTokens: Int, request: Long): String
+
+    // Cancellation: cancelRequest() stops a running or queued call within one decode
+    // and frees its KV sequence. timeoutMs > 0 also stops it at that deadline.
+    external fun createRequest(timeoutMs: Long): Long
+    external fun cancelRequest(request: Long): Boolean
+    external fun releaseRequest(request: Long)
+
+    // Native decode loop writes into a shared ring that the UI drains once per frame
+    external fun createTokenRing(capacity: Int): ByteBuffer
+    external fun freeTokenRing(ring: ByteBuffer)
+    external fun runTextToRing(prompt: String, modelPath: String, ring: ByteBuffer, request: Long): Boolean
+
+    // Multi-turn chat: the session keeps its KV cache between turns. Returns 0 on failure.
+    external fun createSession(modelPath: String): Long
+    // Starts with a system message; uses the KV snapshot baked into assets/kv/ when one matches
+    external fun createSessionWithSystemPrompt(modelPath: String, systemPrompt: String): Long
+    external fun sessionSend(session: Long, message: String, listener: TokenListener?): String
+    // Both only prefill the tokens after the first change to the cached history
+    external fun sessionRegenerate(session: Long, listener: TokenListener?): String
+    external fun sessionEdit(session: Long, messageIndex: Int, content: String, listener: TokenListener?): String
+    external fun closeSession(session: Long)
+
+    // Snapshots (history + KV state) are saved in the background after every turn and
+    // restored on first use after resumeSession, so a resumed chat is not prefilled again
+    external fun resumeSession(modelPath: String, snapshotPath: String): Long
+    external fun setSessionSnapshotPath(session: Long, snapshotPath: String)
+    // Flattened as role, content, role, content, ...
+    external fun sessionHistory(session: Long): Array<String>
     external fun runMultimodalLlama(imageData: ByteArray, prompt: String, modelPath: String): String
 
+    // Installs the asset into the content-addressed model store (verified
+    // blobs named by their hash) unless it is already there, and returns the
+    // blob's path for llama to load. Empty on failure.
+    external fun prepareModel(assetName: String): String
+
+    // Models stay resident in native memory between calls; an empty path unloads all of them.
+    // embeddingOnly gives a model used only with embedTexts a minimal generation context; it
+    // applies only when this call is the one that loads the model.
+    external fun loadModel(modelPath: String, embeddingOnly: Boolean = false): Boolean
+    external fun unloadModel(modelPath: String)
+    external fun warmUpModel(modelPath: String)
+    // [hits, misses, reusedTokens, inserts, evictions, bytes, entries] of the KV prefix cache
+    external fun prefixCacheStats(modelPath: String): LongArray
+    // [steps, requests, promptTokens, generatedTokens, decodeUs, maxDecodeStepUs, contextShifts] of the batching engine
+    external fun engineStats(modelPath: String): LongArray
+    // When a sequence fills the context, drop its oldest tokens but the first keepTokens and continue;
+    // applies to engine requests and chat sessions of the model
+    external fun setContextShift(modelPath: String, enabled: Boolean, keepTokens: Int)
+    // Tokens per engine step while requests are generating; caps how long a big prefill delays them
+    external fun setEngineStepBudget(modelPath: String, tokens: Int)
+    // Speculative decoding: a small model of the same family drafts tokens for the target.
+    // Pass "" to turn it off. Returns false if either model is not loaded, the models do not
+    // share a vocabulary, or the draft model (through its own drafts) drafts for the target.
+    external fun setDraftModel(modelPath: String, draftModelPath: String): Boolean
+    // Draft-free speculation that copies spans from the prompt; pays off for summaries and edits
+    external fun setPromptLookup(modelPath: String, enabled: Boolean)
+    // Memory-mapped n-gram table learned from past generations (one file per model); "" turns it off
+    external fun setNgramCache(modelPath: String, cachePath: String): Boolean
+    // Drafts from several sources verified together as a token tree; 1 keeps a single chain
+    external fun setDraftBranches(modelPath: String, branches: Int)
+    // [steps, drafted, accepted] per draft source, in the order of DraftKind in speculative.h
+    external fun speculationStats(modelPath: String): LongArray
+    // Unit-length sentence embeddings, packed row-major: texts.size rows of the model's dimension.
+    // pooling is a llama_pooling_type (-1 = the model's own). Empty on failure.
+    external fun embedTexts(modelPath: String, texts: Array<String>, pooling: Int): FloatArray
+    // Memory-mapped nearest-neighbour index over embeddings; rows are numbered in insertion order.
+    // quantized stores Q8_0 (about 1 byte per value), otherwise fp16. Returns 0 on failure.
+    external fun openVectorIndex(path: String, dimension: Int, quantized: Boolean): Long
+    // Appends vectors packed as embedTexts returns them; returns the first new row, or -1
+    external fun vectorIndexAdd(index: Long, vectors: FloatArray): Long
+    // Rows of the k best matches, best first; their scores go to `scores` if it is big enough
+    external fun vectorIndexSearch(index: Long, query: FloatArray, k: Int, scores: FloatArray?): IntArray
+    // HNSW graph for large indexes: faster than the full scan, approximate, rebuilt on every open
+    external fun setVectorIndexGraph(index: Long, enabled: Boolean)
+    external fun closeVectorIndex(index: Long)
+
     private lateinit var outputView: TextView
     private lateinit var textInput: EditText
     private lateinit var loginStatus: TextView
@@ -46,6 +130,12 @@ class MainActivity : AppCompatActivity() {
     private val TEXT_MODEL_PATH = "d:/GitDesk/Automated-Integration-App/app/src/main/assets/Qwen3-0.6B-UD-Q5_K_XL.gguf/"
     private val MULTIMODAL_MODEL_PATH = "app/src/main/assets/gemma-3-4b-it-Q4_1.gguf" // Update with your actual Gemma 3 model filename
 
+    // Load the text model in the background at startup so the first request skips the load
+    private val WARM_UP_ON_START = true
+
+    // Upper bound on one text generation, prefill included
+    private val GENERATION_TIMEOUT_MS = 120_000L
+
     @SuppressLint("SetTextI18n")
     override fun onCreate(savedInstanceState: Bundle?) {
         super.onCreate(savedInstanceState)
@@ -111,6 +201,24 @@ class MainActivity : AppCompatActivity() {
 
         // Status placeholder
         loginStatus.text = "Logged in via LoginActivity"
+
+        if (WARM_UP_ON_START) {
+            CoroutineScope(Dispatchers.IO).launch {
+                try {
+                    warmUpModel(getModelPath("Qwen3-0.6B-UD-Q5_K_XL.gguf"))
+                } catch (e: Exception) {
+                    // Warm-up is best effort; the first request loads the model instead
+                }
+            }
+        }
+    }
+
+    override fun onDestroy() {
+        super.onDestroy()
+        // Keep models across configuration changes, release them when the user leaves
+        if (isFinishing) {
+            unloadModel("")
+        }
     }
 
     override fun onActivityResult(requestCode: Int, resultCode: Int, data: Intent?) {
@@ -126,20 +234,38 @@ class MainActivity : AppCompatActivity() {
         // Show loading state
         outputView.text = "Processing..."
 
-        // Run in background thread
-        CoroutineScope(Dispatchers.IO).launch {
+        CoroutineScope(Dispatchers.Main).launch {
             try {
-                val modelPath = getModelPath("Qwen3-0.6B-UD-Q5_K_XL.gguf")
-                val result = runTextOnlyLlama(input, modelPath)
+                val modelPath = withContext(Dispatchers.IO) {
+                    getModelPath("Qwen3-0.6B-UD-Q5_K_XL.gguf")
+                }
 
-                // Update UI on main thread
-                withContext(Dispatchers.Main) {
-                    outputView.text = result
+                // Show the prompt, then append text as it is generated
+                outputView.text = input
+                val ring = TokenRing(createTokenRing(64 * 1024))
+                val request = createRequest(GENERATION_TIMEOUT_MS)
+                val generation = async(Dispatchers.IO) {
+                    runTextToRing(input, modelPath, ring.buffer, request)
                 }
-            } catch (e: Exception) {
-                withContext(Dispatchers.Main) {
-                    outputView.text = "Error: ${e.message}"
+                try {
+                    while (true) {
+                        // State is read before draining so nothing written before FINISHED is missed
+                        val state = ring.state
+                        outputView.append(ring.poll())
+                        if (state != TokenRing.STATE_OPEN) break
+                        delay(16)
+                    }
+                } finally {
+                    // Stop generating for a screen that is gone; the native side may still be
+                    // writing, so free the ring only after it returns
+                    cancelRequest(request)
+                    ring.detach()
+                    withContext(NonCancellable) { generation.join() }
+                    releaseRequest(request)
+                    freeTokenRing(ring.buffer)
                 }
+            } catch (e: Exception) {
+                outputView.text = "Error: ${e.message}"
             }
         }
     }
@@ -151,7 +277,8 @@ class MainActivity : AppCompatActivity() {
         // Run in background thread
         CoroutineScope(Dispatchers.IO).launch {
             try {
-                val result = runMultimodalLlama(image, prompt, MULTIMODAL_MODEL_PATH)
+                val modelPath = getModelPath("gemma-3-4b-it-Q4_1.gguf")
+                val result = runMultimodalLlama(image, prompt, modelPath)
 
                 // Update UI on main thread
                 withContext(Dispatchers.Main) {
@@ -165,15 +292,20 @@ class MainActivity : AppCompatActivity() {
         }
     }
 
+    // Called from native code on the thread running prepareModel()
+    @Suppress("unused")
+    fun onModelInstallProgress(done: Long, total: Long, mbPerSec: Double) {
+        val percent = if (total > 0) done * 100 / total else 100
+        runOnUiThread {
+            outputView.text = "Installing model: $percent% (${"%.0f".format(mbPerSec)} MB/s)"
+        }
+    }
+
     private fun getModelPath(assetName: String): String {
-        val file = File(filesDir, assetName)
-        if (!file.exists()) {
-            assets.open(assetName).use { input ->
-                file.outputStream().use { output ->
-                    input.copyTo(output)
-                }
-            }
+        val path = prepareModel(assetName)
+        if (path.isEmpty()) {
+            throw IllegalStateException("Failed to prepare model $assetName")
         }
-        return file.absolutePath
+        return path
     }
 }
\ No newline at end of file
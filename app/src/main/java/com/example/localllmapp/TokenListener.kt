@@ -0,0 +1,7 @@
+package com.example.localllmapp
+
+// Receives generated text from native code while decoding is still running.
+// Called on the generation thread with deltas batched by size or time.
+fun interface TokenListener {
+    fun onTokens(delta: String)
+}
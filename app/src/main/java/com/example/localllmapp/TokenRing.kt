@@ -0,0 +1,75 @@
+package com.example.localllmapp
+
+import java.lang.invoke.MethodHandles
+import java.lang.invoke.VarHandle
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+import java.nio.CharBuffer
+import java.nio.charset.CodingErrorAction
+
+// Consumer side of the native single-producer/single-consumer byte ring
+// (see token-ring.h for the shared layout). Polling reads shared memory only,
+// so draining it costs no JNI calls.
+class TokenRing(val buffer: ByteBuffer) {
+    companion object {
+        private const val HEAD_OFFSET = 0
+        private const val TAIL_OFFSET = 64
+        private const val STATE_OFFSET = 128
+        private const val CAPACITY_OFFSET = 132
+        private const val DATA_OFFSET = 192
+
+        const val STATE_OPEN = 0
+        const val STATE_FINISHED = 1
+        const val STATE_FAILED = 2
+        const val STATE_DETACHED = 3
+
+        private val LONGS: VarHandle =
+            MethodHandles.byteBufferViewVarHandle(LongArray::class.java, ByteOrder.nativeOrder())
+        private val INTS: VarHandle =
+            MethodHandles.byteBufferViewVarHandle(IntArray::class.java, ByteOrder.nativeOrder())
+    }
+
+    private val capacity = INTS.get(buffer, CAPACITY_OFFSET) as Int
+    private val data = buffer.duplicate().order(ByteOrder.nativeOrder())
+    private val scratch = ByteArray(capacity)
+    private val decoder = Charsets.UTF_8.newDecoder()
+        .onMalformedInput(CodingErrorAction.REPLACE)
+        .onUnmappableCharacter(CodingErrorAction.REPLACE)
+    private val pending = ByteBuffer.allocate(capacity + 4)
+    private val chars = CharBuffer.allocate(capacity + 4)
+
+    val state: Int
+        get() = INTS.getAcquire(buffer, STATE_OFFSET) as Int
+
+    // Returns the text written since the last call; an incomplete trailing
+    // UTF-8 sequence is held back until the rest of it arrives
+    fun poll(): String {
+        val head = LONGS.getAcquire(buffer, HEAD_OFFSET) as Long
+        val tail = LONGS.get(buffer, TAIL_OFFSET) as Long
+        val available = (head - tail).toInt()
+        if (available == 0) return ""
+
+        val start = (tail and (capacity - 1).toLong()).toInt()
+        val first = minOf(available, capacity - start)
+        data.position(DATA_OFFSET + start)
+        data.get(scratch, 0, first)
+        if (available > first) {
+            data.position(DATA_OFFSET)
+            data.get(scratch, first, available - first)
+        }
+        LONGS.setRelease(buffer, TAIL_OFFSET, head)
+
+        pending.put(scratch, 0, available)
+        pending.flip()
+        chars.clear()
+        decoder.decode(pending, chars, false)
+        pending.compact()
+        chars.flip()
+        return chars.toString()
+    }
+
+    // Tells the producer to stop writing; it will not block on a full ring again
+    fun detach() {
+        INTS.compareAndSet(buffer, STATE_OFFSET, STATE_OPEN, STATE_DETACHED)
+    }
+}